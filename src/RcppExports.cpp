@@ -1,6 +1,7 @@
 // Generated by using Rcpp::compileAttributes() -> do not edit by hand
 // Generator token: 10BE3573-1514-4C36-9D1C-5A225CD40393
 
+#include <RcppParallel.h>
 #include <Rcpp.h>
 
 using namespace Rcpp;
@@ -11,93 +12,541 @@ Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
 // pf_barnes2014
-NumericMatrix pf_barnes2014(NumericMatrix dem);
-RcppExport SEXP _flowdem_pf_barnes2014(SEXP demSEXP) {
+SEXP pf_barnes2014(SEXP dem, std::string queue, bool stats);
+RcppExport SEXP _flowdem_pf_barnes2014(SEXP demSEXP, SEXP queueSEXP, SEXP statsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< NumericMatrix >::type dem(demSEXP);
-    rcpp_result_gen = Rcpp::wrap(pf_barnes2014(dem));
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< std::string >::type queue(queueSEXP);
+    Rcpp::traits::input_parameter< bool >::type stats(statsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pf_barnes2014(dem, queue, stats));
     return rcpp_result_gen;
 END_RCPP
 }
 // pf_eps_barnes2014
-NumericMatrix pf_eps_barnes2014(NumericMatrix dem);
-RcppExport SEXP _flowdem_pf_eps_barnes2014(SEXP demSEXP) {
+NumericMatrix pf_eps_barnes2014(NumericMatrix dem, bool stats);
+RcppExport SEXP _flowdem_pf_eps_barnes2014(SEXP demSEXP, SEXP statsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< NumericMatrix >::type dem(demSEXP);
-    rcpp_result_gen = Rcpp::wrap(pf_eps_barnes2014(dem));
+    Rcpp::traits::input_parameter< bool >::type stats(statsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pf_eps_barnes2014(dem, stats));
     return rcpp_result_gen;
 END_RCPP
 }
 // pf_basins_barnes2014
-List pf_basins_barnes2014(NumericMatrix dem);
-RcppExport SEXP _flowdem_pf_basins_barnes2014(SEXP demSEXP) {
+SEXP pf_basins_barnes2014(SEXP dem, std::string queue, bool stats, std::string scratch_dir);
+RcppExport SEXP _flowdem_pf_basins_barnes2014(SEXP demSEXP, SEXP queueSEXP, SEXP statsSEXP, SEXP scratch_dirSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< NumericMatrix >::type dem(demSEXP);
-    rcpp_result_gen = Rcpp::wrap(pf_basins_barnes2014(dem));
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< std::string >::type queue(queueSEXP);
+    Rcpp::traits::input_parameter< bool >::type stats(statsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type scratch_dir(scratch_dirSEXP);
+    rcpp_result_gen = Rcpp::wrap(pf_basins_barnes2014(dem, queue, stats, scratch_dir));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pf_flowdirs_barnes2014
+SEXP pf_flowdirs_barnes2014(SEXP dem, std::string queue, bool stats);
+RcppExport SEXP _flowdem_pf_flowdirs_barnes2014(SEXP demSEXP, SEXP queueSEXP, SEXP statsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< std::string >::type queue(queueSEXP);
+    Rcpp::traits::input_parameter< bool >::type stats(statsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pf_flowdirs_barnes2014(dem, queue, stats));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pf_depressions_barnes2020
+SEXP pf_depressions_barnes2020(SEXP dem, std::string queue, bool stats);
+RcppExport SEXP _flowdem_pf_depressions_barnes2020(SEXP demSEXP, SEXP queueSEXP, SEXP statsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< std::string >::type queue(queueSEXP);
+    Rcpp::traits::input_parameter< bool >::type stats(statsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pf_depressions_barnes2020(dem, queue, stats));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pf_parallel_barnes2016
+SEXP pf_parallel_barnes2016(SEXP dem, int tile_size, int threads);
+RcppExport SEXP _flowdem_pf_parallel_barnes2016(SEXP demSEXP, SEXP tile_sizeSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< int >::type tile_size(tile_sizeSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pf_parallel_barnes2016(dem, tile_size, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pf_tile_spill_barnes2016
+SEXP pf_tile_spill_barnes2016(SEXP dem);
+RcppExport SEXP _flowdem_pf_tile_spill_barnes2016(SEXP demSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    rcpp_result_gen = Rcpp::wrap(pf_tile_spill_barnes2016(dem));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pf_spill_levels_barnes2016
+List pf_spill_levels_barnes2016(List tiles, int nrow, int ncol, int tile_nrow, int tile_ncol);
+RcppExport SEXP _flowdem_pf_spill_levels_barnes2016(SEXP tilesSEXP, SEXP nrowSEXP, SEXP ncolSEXP, SEXP tile_nrowSEXP, SEXP tile_ncolSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type tiles(tilesSEXP);
+    Rcpp::traits::input_parameter< int >::type nrow(nrowSEXP);
+    Rcpp::traits::input_parameter< int >::type ncol(ncolSEXP);
+    Rcpp::traits::input_parameter< int >::type tile_nrow(tile_nrowSEXP);
+    Rcpp::traits::input_parameter< int >::type tile_ncol(tile_ncolSEXP);
+    rcpp_result_gen = Rcpp::wrap(pf_spill_levels_barnes2016(tiles, nrow, ncol, tile_nrow, tile_ncol));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pf_tile_fill_barnes2016
+SEXP pf_tile_fill_barnes2016(SEXP dem, NumericVector levels);
+RcppExport SEXP _flowdem_pf_tile_fill_barnes2016(SEXP demSEXP, SEXP levelsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type levels(levelsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pf_tile_fill_barnes2016(dem, levels));
     return rcpp_result_gen;
 END_RCPP
 }
 // comp_breach_lindsay2016
-NumericMatrix comp_breach_lindsay2016(NumericMatrix dem);
-RcppExport SEXP _flowdem_comp_breach_lindsay2016(SEXP demSEXP) {
+SEXP comp_breach_lindsay2016(SEXP dem, std::string queue, bool stats, std::string scratch_dir, double max_depth, double max_length, bool fill);
+RcppExport SEXP _flowdem_comp_breach_lindsay2016(SEXP demSEXP, SEXP queueSEXP, SEXP statsSEXP, SEXP scratch_dirSEXP, SEXP max_depthSEXP, SEXP max_lengthSEXP, SEXP fillSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< NumericMatrix >::type dem(demSEXP);
-    rcpp_result_gen = Rcpp::wrap(comp_breach_lindsay2016(dem));
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< std::string >::type queue(queueSEXP);
+    Rcpp::traits::input_parameter< bool >::type stats(statsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type scratch_dir(scratch_dirSEXP);
+    Rcpp::traits::input_parameter< double >::type max_depth(max_depthSEXP);
+    Rcpp::traits::input_parameter< double >::type max_length(max_lengthSEXP);
+    Rcpp::traits::input_parameter< bool >::type fill(fillSEXP);
+    rcpp_result_gen = Rcpp::wrap(comp_breach_lindsay2016(dem, queue, stats, scratch_dir, max_depth, max_length, fill));
     return rcpp_result_gen;
 END_RCPP
 }
 // d8_flow_directions
-IntegerMatrix d8_flow_directions(NumericMatrix dem);
-RcppExport SEXP _flowdem_d8_flow_directions(SEXP demSEXP) {
+SEXP d8_flow_directions(SEXP dem, int threads, bool raw, bool flats);
+RcppExport SEXP _flowdem_d8_flow_directions(SEXP demSEXP, SEXP threadsSEXP, SEXP rawSEXP, SEXP flatsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< NumericMatrix >::type dem(demSEXP);
-    rcpp_result_gen = Rcpp::wrap(d8_flow_directions(dem));
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type raw(rawSEXP);
+    Rcpp::traits::input_parameter< bool >::type flats(flatsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_flow_directions(dem, threads, raw, flats));
     return rcpp_result_gen;
 END_RCPP
 }
 // d8_flow_accum
-NumericMatrix d8_flow_accum(IntegerMatrix flowdirs);
+NumericMatrix d8_flow_accum(SEXP flowdirs);
 RcppExport SEXP _flowdem_d8_flow_accum(SEXP flowdirsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< IntegerMatrix >::type flowdirs(flowdirsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type flowdirs(flowdirsSEXP);
     rcpp_result_gen = Rcpp::wrap(d8_flow_accum(flowdirs));
     return rcpp_result_gen;
 END_RCPP
 }
+// d8_weighted_flow_accum
+NumericVector d8_weighted_flow_accum(SEXP flowdirs, NumericVector weights);
+RcppExport SEXP _flowdem_d8_weighted_flow_accum(SEXP flowdirsSEXP, SEXP weightsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type flowdirs(flowdirsSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type weights(weightsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_weighted_flow_accum(flowdirs, weights));
+    return rcpp_result_gen;
+END_RCPP
+}
+// dinf_flow_directions
+SEXP dinf_flow_directions(SEXP dem, int threads);
+RcppExport SEXP _flowdem_dinf_flow_directions(SEXP demSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(dinf_flow_directions(dem, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// dinf_flow_accum
+NumericMatrix dinf_flow_accum(NumericMatrix angles, int threads);
+RcppExport SEXP _flowdem_dinf_flow_accum(SEXP anglesSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type angles(anglesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(dinf_flow_accum(angles, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// mfd_flow_accum
+NumericMatrix mfd_flow_accum(SEXP dem, double exponent, int threads);
+RcppExport SEXP _flowdem_mfd_flow_accum(SEXP demSEXP, SEXP exponentSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< double >::type exponent(exponentSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(mfd_flow_accum(dem, exponent, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_tile_links_barnes2017
+List d8_tile_links_barnes2017(IntegerMatrix flowdirs);
+RcppExport SEXP _flowdem_d8_tile_links_barnes2017(SEXP flowdirsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< IntegerMatrix >::type flowdirs(flowdirsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_tile_links_barnes2017(flowdirs));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_link_inflow_barnes2017
+List d8_link_inflow_barnes2017(List tiles, int nrow, int ncol, int tile_nrow, int tile_ncol);
+RcppExport SEXP _flowdem_d8_link_inflow_barnes2017(SEXP tilesSEXP, SEXP nrowSEXP, SEXP ncolSEXP, SEXP tile_nrowSEXP, SEXP tile_ncolSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type tiles(tilesSEXP);
+    Rcpp::traits::input_parameter< int >::type nrow(nrowSEXP);
+    Rcpp::traits::input_parameter< int >::type ncol(ncolSEXP);
+    Rcpp::traits::input_parameter< int >::type tile_nrow(tile_nrowSEXP);
+    Rcpp::traits::input_parameter< int >::type tile_ncol(tile_ncolSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_link_inflow_barnes2017(tiles, nrow, ncol, tile_nrow, tile_ncol));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_tile_flow_accum_barnes2017
+NumericMatrix d8_tile_flow_accum_barnes2017(IntegerMatrix flowdirs, NumericVector inflow);
+RcppExport SEXP _flowdem_d8_tile_flow_accum_barnes2017(SEXP flowdirsSEXP, SEXP inflowSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< IntegerMatrix >::type flowdirs(flowdirsSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type inflow(inflowSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_tile_flow_accum_barnes2017(flowdirs, inflow));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_parallel_flow_accum_barnes2017
+NumericMatrix d8_parallel_flow_accum_barnes2017(SEXP flowdirs, int tile_size, int threads);
+RcppExport SEXP _flowdem_d8_parallel_flow_accum_barnes2017(SEXP flowdirsSEXP, SEXP tile_sizeSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type flowdirs(flowdirsSEXP);
+    Rcpp::traits::input_parameter< int >::type tile_size(tile_sizeSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_parallel_flow_accum_barnes2017(flowdirs, tile_size, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
 // d8_watershed_nested
-IntegerMatrix d8_watershed_nested(IntegerMatrix flowdirs, NumericMatrix target_rc, bool nested);
-RcppExport SEXP _flowdem_d8_watershed_nested(SEXP flowdirsSEXP, SEXP target_rcSEXP, SEXP nestedSEXP) {
+SEXP d8_watershed_nested(SEXP flowdirs, NumericMatrix target_rc, bool nested, bool polygons);
+RcppExport SEXP _flowdem_d8_watershed_nested(SEXP flowdirsSEXP, SEXP target_rcSEXP, SEXP nestedSEXP, SEXP polygonsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type flowdirs(flowdirsSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type target_rc(target_rcSEXP);
+    Rcpp::traits::input_parameter< bool >::type nested(nestedSEXP);
+    Rcpp::traits::input_parameter< bool >::type polygons(polygonsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_watershed_nested(flowdirs, target_rc, nested, polygons));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_watershed_hierarchy
+List d8_watershed_hierarchy(SEXP flowdirs, NumericMatrix target_rc, bool polygons);
+RcppExport SEXP _flowdem_d8_watershed_hierarchy(SEXP flowdirsSEXP, SEXP target_rcSEXP, SEXP polygonsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type flowdirs(flowdirsSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type target_rc(target_rcSEXP);
+    Rcpp::traits::input_parameter< bool >::type polygons(polygonsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_watershed_hierarchy(flowdirs, target_rc, polygons));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_flow_index
+SEXP d8_flow_index(SEXP flowdirs);
+RcppExport SEXP _flowdem_d8_flow_index(SEXP flowdirsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type flowdirs(flowdirsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_flow_index(flowdirs));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_index_upstream_cells
+List d8_index_upstream_cells(SEXP index, IntegerVector cells);
+RcppExport SEXP _flowdem_d8_index_upstream_cells(SEXP indexSEXP, SEXP cellsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type cells(cellsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_index_upstream_cells(index, cells));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_index_upstream_count
+IntegerVector d8_index_upstream_count(SEXP index, IntegerVector cells);
+RcppExport SEXP _flowdem_d8_index_upstream_count(SEXP indexSEXP, SEXP cellsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type cells(cellsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_index_upstream_count(index, cells));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_index_is_upstream
+LogicalVector d8_index_is_upstream(SEXP index, IntegerVector from, IntegerVector to);
+RcppExport SEXP _flowdem_d8_index_is_upstream(SEXP indexSEXP, SEXP fromSEXP, SEXP toSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type from(fromSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type to(toSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_index_is_upstream(index, from, to));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_update
+List d8_update(NumericMatrix dem, NumericMatrix filled, IntegerMatrix flowdirs, NumericMatrix area, IntegerVector cells, NumericVector values);
+RcppExport SEXP _flowdem_d8_update(SEXP demSEXP, SEXP filledSEXP, SEXP flowdirsSEXP, SEXP areaSEXP, SEXP cellsSEXP, SEXP valuesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type filled(filledSEXP);
     Rcpp::traits::input_parameter< IntegerMatrix >::type flowdirs(flowdirsSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type area(areaSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type cells(cellsSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type values(valuesSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_update(dem, filled, flowdirs, area, cells, values));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_stream_network
+List d8_stream_network(SEXP flowdirs, NumericMatrix area, double threshold, double xres, double yres);
+RcppExport SEXP _flowdem_d8_stream_network(SEXP flowdirsSEXP, SEXP areaSEXP, SEXP thresholdSEXP, SEXP xresSEXP, SEXP yresSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type flowdirs(flowdirsSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type area(areaSEXP);
+    Rcpp::traits::input_parameter< double >::type threshold(thresholdSEXP);
+    Rcpp::traits::input_parameter< double >::type xres(xresSEXP);
+    Rcpp::traits::input_parameter< double >::type yres(yresSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_stream_network(flowdirs, area, threshold, xres, yres));
+    return rcpp_result_gen;
+END_RCPP
+}
+// batch_pipeline
+List batch_pipeline(List dems, std::vector<std::string> steps, int threads);
+RcppExport SEXP _flowdem_batch_pipeline(SEXP demsSEXP, SEXP stepsSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type dems(demsSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type steps(stepsSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(batch_pipeline(dems, steps, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_model_build
+SEXP d8_model_build(NumericMatrix dem, std::string condition);
+RcppExport SEXP _flowdem_d8_model_build(SEXP demSEXP, SEXP conditionSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type dem(demSEXP);
+    Rcpp::traits::input_parameter< std::string >::type condition(conditionSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_model_build(dem, condition));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_model_layer
+SEXP d8_model_layer(SEXP model, std::string layer);
+RcppExport SEXP _flowdem_d8_model_layer(SEXP modelSEXP, SEXP layerSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< std::string >::type layer(layerSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_model_layer(model, layer));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_model_accum
+NumericVector d8_model_accum(SEXP model, IntegerVector cells);
+RcppExport SEXP _flowdem_d8_model_accum(SEXP modelSEXP, SEXP cellsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type cells(cellsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_model_accum(model, cells));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_model_weighted_accum
+NumericVector d8_model_weighted_accum(SEXP model, NumericVector weights);
+RcppExport SEXP _flowdem_d8_model_weighted_accum(SEXP modelSEXP, SEXP weightsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type weights(weightsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_model_weighted_accum(model, weights));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_model_watershed
+SEXP d8_model_watershed(SEXP model, NumericMatrix target_rc, bool nested, bool polygons);
+RcppExport SEXP _flowdem_d8_model_watershed(SEXP modelSEXP, SEXP target_rcSEXP, SEXP nestedSEXP, SEXP polygonsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
     Rcpp::traits::input_parameter< NumericMatrix >::type target_rc(target_rcSEXP);
     Rcpp::traits::input_parameter< bool >::type nested(nestedSEXP);
-    rcpp_result_gen = Rcpp::wrap(d8_watershed_nested(flowdirs, target_rc, nested));
+    Rcpp::traits::input_parameter< bool >::type polygons(polygonsSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_model_watershed(model, target_rc, nested, polygons));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_model_streams
+List d8_model_streams(SEXP model, double threshold, double xres, double yres);
+RcppExport SEXP _flowdem_d8_model_streams(SEXP modelSEXP, SEXP thresholdSEXP, SEXP xresSEXP, SEXP yresSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< double >::type threshold(thresholdSEXP);
+    Rcpp::traits::input_parameter< double >::type xres(xresSEXP);
+    Rcpp::traits::input_parameter< double >::type yres(yresSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_model_streams(model, threshold, xres, yres));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_model_upstream
+SEXP d8_model_upstream(SEXP model, IntegerVector cells, bool count);
+RcppExport SEXP _flowdem_d8_model_upstream(SEXP modelSEXP, SEXP cellsSEXP, SEXP countSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type cells(cellsSEXP);
+    Rcpp::traits::input_parameter< bool >::type count(countSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_model_upstream(model, cells, count));
+    return rcpp_result_gen;
+END_RCPP
+}
+// d8_model_is_upstream
+LogicalVector d8_model_is_upstream(SEXP model, IntegerVector from, IntegerVector to);
+RcppExport SEXP _flowdem_d8_model_is_upstream(SEXP modelSEXP, SEXP fromSEXP, SEXP toSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type from(fromSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type to(toSEXP);
+    rcpp_result_gen = Rcpp::wrap(d8_model_is_upstream(model, from, to));
+    return rcpp_result_gen;
+END_RCPP
+}
+// synthetic_dem
+NumericMatrix synthetic_dem(int nrow, int ncol, int seed, double pit_density, double flat_fraction, int octaves, int threads);
+RcppExport SEXP _flowdem_synthetic_dem(SEXP nrowSEXP, SEXP ncolSEXP, SEXP seedSEXP, SEXP pit_densitySEXP, SEXP flat_fractionSEXP, SEXP octavesSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type nrow(nrowSEXP);
+    Rcpp::traits::input_parameter< int >::type ncol(ncolSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< double >::type pit_density(pit_densitySEXP);
+    Rcpp::traits::input_parameter< double >::type flat_fraction(flat_fractionSEXP);
+    Rcpp::traits::input_parameter< int >::type octaves(octavesSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(synthetic_dem(nrow, ncol, seed, pit_density, flat_fraction, octaves, threads));
     return rcpp_result_gen;
 END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_flowdem_pf_barnes2014", (DL_FUNC) &_flowdem_pf_barnes2014, 1},
-    {"_flowdem_pf_eps_barnes2014", (DL_FUNC) &_flowdem_pf_eps_barnes2014, 1},
-    {"_flowdem_pf_basins_barnes2014", (DL_FUNC) &_flowdem_pf_basins_barnes2014, 1},
-    {"_flowdem_comp_breach_lindsay2016", (DL_FUNC) &_flowdem_comp_breach_lindsay2016, 1},
-    {"_flowdem_d8_flow_directions", (DL_FUNC) &_flowdem_d8_flow_directions, 1},
+    {"_flowdem_pf_barnes2014", (DL_FUNC) &_flowdem_pf_barnes2014, 3},
+    {"_flowdem_pf_eps_barnes2014", (DL_FUNC) &_flowdem_pf_eps_barnes2014, 2},
+    {"_flowdem_pf_basins_barnes2014", (DL_FUNC) &_flowdem_pf_basins_barnes2014, 4},
+    {"_flowdem_pf_flowdirs_barnes2014", (DL_FUNC) &_flowdem_pf_flowdirs_barnes2014, 3},
+    {"_flowdem_pf_depressions_barnes2020", (DL_FUNC) &_flowdem_pf_depressions_barnes2020, 3},
+    {"_flowdem_pf_parallel_barnes2016", (DL_FUNC) &_flowdem_pf_parallel_barnes2016, 3},
+    {"_flowdem_pf_tile_spill_barnes2016", (DL_FUNC) &_flowdem_pf_tile_spill_barnes2016, 1},
+    {"_flowdem_pf_spill_levels_barnes2016", (DL_FUNC) &_flowdem_pf_spill_levels_barnes2016, 5},
+    {"_flowdem_pf_tile_fill_barnes2016", (DL_FUNC) &_flowdem_pf_tile_fill_barnes2016, 2},
+    {"_flowdem_comp_breach_lindsay2016", (DL_FUNC) &_flowdem_comp_breach_lindsay2016, 7},
+    {"_flowdem_d8_flow_directions", (DL_FUNC) &_flowdem_d8_flow_directions, 4},
     {"_flowdem_d8_flow_accum", (DL_FUNC) &_flowdem_d8_flow_accum, 1},
-    {"_flowdem_d8_watershed_nested", (DL_FUNC) &_flowdem_d8_watershed_nested, 3},
+    {"_flowdem_d8_weighted_flow_accum", (DL_FUNC) &_flowdem_d8_weighted_flow_accum, 2},
+    {"_flowdem_dinf_flow_directions", (DL_FUNC) &_flowdem_dinf_flow_directions, 2},
+    {"_flowdem_dinf_flow_accum", (DL_FUNC) &_flowdem_dinf_flow_accum, 2},
+    {"_flowdem_mfd_flow_accum", (DL_FUNC) &_flowdem_mfd_flow_accum, 3},
+    {"_flowdem_d8_tile_links_barnes2017", (DL_FUNC) &_flowdem_d8_tile_links_barnes2017, 1},
+    {"_flowdem_d8_link_inflow_barnes2017", (DL_FUNC) &_flowdem_d8_link_inflow_barnes2017, 5},
+    {"_flowdem_d8_tile_flow_accum_barnes2017", (DL_FUNC) &_flowdem_d8_tile_flow_accum_barnes2017, 2},
+    {"_flowdem_d8_parallel_flow_accum_barnes2017", (DL_FUNC) &_flowdem_d8_parallel_flow_accum_barnes2017, 3},
+    {"_flowdem_d8_watershed_nested", (DL_FUNC) &_flowdem_d8_watershed_nested, 4},
+    {"_flowdem_d8_watershed_hierarchy", (DL_FUNC) &_flowdem_d8_watershed_hierarchy, 3},
+    {"_flowdem_d8_flow_index", (DL_FUNC) &_flowdem_d8_flow_index, 1},
+    {"_flowdem_d8_index_upstream_cells", (DL_FUNC) &_flowdem_d8_index_upstream_cells, 2},
+    {"_flowdem_d8_index_upstream_count", (DL_FUNC) &_flowdem_d8_index_upstream_count, 2},
+    {"_flowdem_d8_index_is_upstream", (DL_FUNC) &_flowdem_d8_index_is_upstream, 3},
+    {"_flowdem_d8_update", (DL_FUNC) &_flowdem_d8_update, 6},
+    {"_flowdem_d8_stream_network", (DL_FUNC) &_flowdem_d8_stream_network, 5},
+    {"_flowdem_batch_pipeline", (DL_FUNC) &_flowdem_batch_pipeline, 3},
+    {"_flowdem_d8_model_build", (DL_FUNC) &_flowdem_d8_model_build, 2},
+    {"_flowdem_d8_model_layer", (DL_FUNC) &_flowdem_d8_model_layer, 2},
+    {"_flowdem_d8_model_accum", (DL_FUNC) &_flowdem_d8_model_accum, 2},
+    {"_flowdem_d8_model_weighted_accum", (DL_FUNC) &_flowdem_d8_model_weighted_accum, 2},
+    {"_flowdem_d8_model_watershed", (DL_FUNC) &_flowdem_d8_model_watershed, 4},
+    {"_flowdem_d8_model_streams", (DL_FUNC) &_flowdem_d8_model_streams, 4},
+    {"_flowdem_d8_model_upstream", (DL_FUNC) &_flowdem_d8_model_upstream, 3},
+    {"_flowdem_d8_model_is_upstream", (DL_FUNC) &_flowdem_d8_model_is_upstream, 3},
+    {"_flowdem_synthetic_dem", (DL_FUNC) &_flowdem_synthetic_dem, 7},
     {NULL, NULL, 0}
 };
 
@@ -3,10 +3,24 @@
 //Modified to Rcpp for the flowdem R package by Kenneth Thorø Martinsen
 
 #include <Rcpp.h>
+#include <RcppParallel.h>
 #include <queue>
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <array>
+#include <chrono>
+#include <optional>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 using namespace Rcpp;
 using namespace std;
 
+// [[Rcpp::depends(RcppParallel)]]
+
 // Flow coordinate system
 // 234
 // 105
@@ -19,7 +33,6 @@ const int dx[9] =     {0, -1, -1,  0,  1, 1, 1, 0, -1}; ///< x offsets of D8 nei
 const int dy[9] =     {0,  0, -1, -1, -1, 0, 1, 1,  1}; ///< y offsets of D8 neighbours, from a central cell
 
 // Constants used in functions
-double dem_nodata = -9999.0;
 int flowdir_nodata = 0;
 
 // Class used to store row, col and elevation for cells
@@ -31,567 +44,4950 @@ public:
   cell(int r, int c): r(r), c(c){}
 };
 
+// Elevations are stored with the element type of the DEM (int, float or double)
+template <typename T>
 class cellz: 
   public cell{
 public:
-  double z;
+  T z;
   cellz(){}
-  cellz(int r, int c, double z): cell(r, c), z(z){}
+  cellz(int r, int c, T z): cell(r, c), z(z){}
   bool operator> (const cellz &a) const {return z > a.z; }
 };
 
+// Nodata in DEMs is NA (NaN in double DEMs), any other value is an elevation. Nodata cells are never modified by the algorithms.
+inline bool is_nodata(double z){ return ISNAN(z); }
+inline bool is_nodata(float z){ return ISNAN(z); }
+inline bool is_nodata(int z){ return z == NA_INTEGER; }
+
+// Elevation used to order cells, nodata is lower than any elevation so that cells next to it drain into it
+template <typename T>
+inline T elevation(T z){ return is_nodata(z) ? numeric_limits<T>::lowest() : z; }
+
+// Open sets for the priority-flood algorithms
+// All queues take and return cellz and pop the lowest elevation first. They differ in the order of cells with equal 
+// elevation, which does not change the filled DEM but can change basin labels and breaching paths.
+
+// Binary heap (std::priority_queue), the reference order
+template <typename T>
+class heap_queue{
+  priority_queue<cellz<T>, vector<cellz<T>>, greater<cellz<T>>> q;
+public:
+  heap_queue(const T*, int, int){}
+  void push(const cellz<T>& c){ q.push(c); }
+  cellz<T> top() const { return q.top(); }
+  void pop(){ q.pop(); }
+  size_t size() const { return q.size(); }
+  bool empty() const { return q.empty(); }
+};
+
+// Compact queue entry with the linear (column-major) index of the cell instead of row and column
+template <typename T>
+class cellq{
+public:
+  int i;
+  T z;
+  cellq(){}
+  cellq(int i, T z): i(i), z(z){}
+};
+
+// 4-ary heap of compact entries, shallower than a binary heap and with the children of a node in one cache line
+template <typename T>
+class dary_queue{
+  static const size_t D = 4;
+  vector<cellq<T>> h;
+  int nrow;
+public:
+  dary_queue(const T*, int nrow, int): nrow(nrow){}
+  
+  void push(const cellz<T>& c){
+    cellq<T> x(c.c*nrow + c.r, c.z);
+    size_t k = h.size();
+    h.push_back(x);
+    while(k > 0){
+      size_t parent = (k-1)/D;
+      if(!(x.z < h[parent].z))
+        break;
+      h[k] = h[parent];
+      k = parent;
+    }
+    h[k] = x;
+  }
+  
+  cellz<T> top() const {
+    return cellz<T>(h[0].i % nrow, h[0].i / nrow, h[0].z);
+  }
+  
+  void pop(){
+    cellq<T> x = h.back();
+    h.pop_back();
+    size_t n = h.size();
+    if(n == 0)
+      return;
+    size_t k = 0;
+    while(D*k+1 < n){
+      size_t first = D*k+1;
+      size_t last = min(first+D, n);
+      size_t m = first;
+      for(size_t j = first+1; j < last; j++){
+        if(h[j].z < h[m].z)
+          m = j;
+      }
+      if(!(h[m].z < x.z))
+        break;
+      h[k] = h[m];
+      k = m;
+    }
+    h[k] = x;
+  }
+  
+  size_t size() const { return h.size(); }
+  bool empty() const { return h.empty(); }
+};
+
+// Bucket queue for integer DEMs with one first-in-first-out bucket per elevation between the DEM minimum and maximum, 
+// and a first bucket for nodata. Push and pop are O(1) apart from skipping empty buckets. Elevations pushed must lie 
+// within the range of the DEM.
+template <typename T>
+class bucket_queue{
+  vector<vector<int>> buckets;
+  vector<size_t> head;
+  T zmin;
+  size_t current;
+  size_t count;
+  int nrow;
+public:
+  bucket_queue(const T* dem, int nrow, int ncol): current(0), count(0), nrow(nrow){
+    if(!numeric_limits<T>::is_integer)
+      stop("The bucket queue requires an integer DEM");
+    T zmax = numeric_limits<T>::lowest();
+    zmin = numeric_limits<T>::max();
+    size_t n = (size_t) nrow*ncol;
+    for(size_t i = 0; i < n; i++){
+      if(is_nodata(dem[i]))
+        continue;
+      zmin = min(zmin, dem[i]);
+      zmax = max(zmax, dem[i]);
+    }
+    if(zmin > zmax)
+      zmin = zmax = 0;
+    buckets.resize((size_t) (zmax - zmin) + 2);
+    head.resize(buckets.size());
+  }
+  
+  void push(const cellz<T>& c){
+    size_t b = c.z == numeric_limits<T>::lowest() ? 0 : (size_t) (c.z - zmin) + 1;
+    buckets[b].push_back(c.c*nrow + c.r);
+    if(count == 0 || b < current)
+      current = b;
+    count++;
+  }
+  
+  cellz<T> top() const {
+    int i = buckets[current][head[current]];
+    return cellz<T>(i % nrow, i / nrow, current == 0 ? numeric_limits<T>::lowest() : (T) (zmin + (current-1)));
+  }
+  
+  void pop(){
+    if(++head[current] == buckets[current].size()){
+      buckets[current].clear();
+      head[current] = 0;
+    }
+    if(--count == 0)
+      return;
+    while(buckets[current].empty())
+      current++;
+  }
+  
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+};
+
+// Name of the queue used for a DEM, resolving "auto" to the bucket queue for integer DEMs with 
+// no more distinct elevations than cells and to the 4-ary heap otherwise
+template <typename T>
+static string open_queue(const T* dem, size_t n, string queue){
+  if(queue == "auto"){
+    if(!numeric_limits<T>::is_integer || n == 0)
+      return "dary";
+    T zmax = numeric_limits<T>::lowest();
+    T zmin = numeric_limits<T>::max();
+    for(size_t i = 0; i < n; i++){
+      if(is_nodata(dem[i]))
+        continue;
+      zmin = min(zmin, dem[i]);
+      zmax = max(zmax, dem[i]);
+    }
+    return zmin > zmax || (double) zmax - zmin < n ? "bucket" : "dary";
+  }
+  if(queue != "heap" && queue != "dary" && queue != "bucket")
+    stop("queue must be one of 'auto', 'heap', 'dary' or 'bucket'");
+  if(queue == "bucket" && !numeric_limits<T>::is_integer)
+    stop("The bucket queue requires an integer DEM");
+  return queue;
+}
+
+// Access to a column-major grid (an R matrix) by linear index.
+// Neighbour n of cell i is i + offset[n], which is valid for interior cells or after checking inside(). Sweeps over 
+// all cells should loop over columns on the outside and rows on the inside, so that they follow the storage order.
+class grid{
+public:
+  int nrow;
+  int ncol;
+  ptrdiff_t offset[9];
+  
+  grid(int nrow, int ncol): nrow(nrow), ncol(ncol){
+    for(int n = 0; n <= 8; n++)
+      offset[n] = (ptrdiff_t) dx[n]*nrow + dy[n];
+  }
+  
+  size_t size() const { return (size_t) nrow*ncol; }
+  size_t index(int r, int c) const { return (size_t) c*nrow + r; }
+  int row(size_t i) const { return i % nrow; }
+  int col(size_t i) const { return i / nrow; }
+  bool inside(int r, int c) const { return 0 <= r && r < nrow && 0 <= c && c < ncol; }
+  bool edge(int r, int c) const { return r == 0 || c == 0 || r == nrow-1 || c == ncol-1; }
+};
+
+// Column-major view of the values of a matrix. Unlike Rcpp matrices, views can be copied outside the main thread, 
+// so kernels taking views can run on worker threads.
+template <typename T>
+class matrix_view{
+  T* values;
+  int rows;
+  int cols;
+public:
+  matrix_view(T* values, int nrow, int ncol): values(values), rows(nrow), cols(ncol){}
+  template <int RTYPE>
+  matrix_view(Matrix<RTYPE>& m): values(m.begin()), rows(m.nrow()), cols(m.ncol()){}
+  
+  T* begin() const { return values; }
+  int nrow() const { return rows; }
+  int ncol() const { return cols; }
+  size_t size() const { return (size_t) rows*cols; }
+  T& operator[](size_t i) const { return values[i]; }
+  T& operator()(int r, int c) const { return values[(size_t) c*rows + r]; }
+};
+
+// One bit flag per cell of a grid, used for the closed and pit sets instead of logical matrices
+class bit_grid{
+  vector<uint64_t> bits;
+public:
+  bit_grid(const grid& g): bits((g.size() + 63)/64){}
+  
+  bool operator[](size_t i) const { return (bits[i >> 6] >> (i & 63)) & 1; }
+  void set(size_t i){ bits[i >> 6] |= (uint64_t) 1 << (i & 63); }
+};
+
+// Scratch grids hold the working state of a kernel (back links, visited and closed sets). By default they are in memory. 
+// With a scratch directory they are temporary files mapped into memory, which the operating system pages to and from disk 
+// when the grids do not fit in memory. Mapped grids are stored in blocks of 64 x 64 cells, so the neighbours of a cell are 
+// usually in the same pages and the pages in use follow the front of the priority flood instead of spanning whole columns.
+
+// Position of cell i in blocks of 64 x 64 cells, blocks and cells within blocks are column-major
+class block_layout{
+  int nrow;
+  size_t block_rows;
+  size_t blocks;
+public:
+  block_layout(const grid& g): nrow(g.nrow), block_rows((g.nrow + 63)/64), blocks(block_rows*((g.ncol + 63)/64)){}
+  
+  size_t size() const { return blocks << 12; }
+  size_t operator()(size_t i) const {
+    size_t r = i % nrow, c = i / nrow;
+    return (((c >> 6)*block_rows + (r >> 6)) << 12) + ((c & 63) << 6) + (r & 63);
+  }
+};
+
+// Temporary file in dir mapped into memory, the file is removed as soon as it is mapped
+class mapped_file{
+  void* data;
+  size_t bytes;
+public:
+  mapped_file(size_t bytes, const string& dir): data(nullptr), bytes(max(bytes, (size_t) 1)){
+#ifdef _WIN32
+    stop("Memory-mapped scratch grids are not supported on Windows");
+#else
+    string path = dir + "/flowdem_scratch_XXXXXX";
+    vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    
+    int fd = mkstemp(name.data());
+    if(fd == -1)
+      stop("Can not create a scratch file in " + dir);
+    unlink(name.data());
+    
+    if(ftruncate(fd, this->bytes) != 0){
+      close(fd);
+      stop("Can not allocate a scratch file of " + std::to_string(this->bytes) + " bytes in " + dir);
+    }
+    
+    data = mmap(nullptr, this->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+      stop("Can not map a scratch file into memory");
+#endif
+  }
+  
+  ~mapped_file(){
+#ifndef _WIN32
+    if(data != nullptr && data != MAP_FAILED)
+      munmap(data, bytes);
+#endif
+  }
+  
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  
+  void* get() const { return data; }
+};
+
+// Scratch grid of values in memory, indexed by the linear index of the grid
+template <typename T>
+class memory_grid{
+  vector<T> values;
+public:
+  memory_grid(const grid& g, T value, const string&): values(g.size(), value){}
+  
+  T& operator[](size_t i){ return values[i]; }
+};
+
+// Scratch grid of values in a mapped file, in blocks
+template <typename T>
+class mapped_grid{
+  block_layout layout;
+  mapped_file file;
+  T* values;
+public:
+  mapped_grid(const grid& g, T value, const string& dir): layout(g), file(layout.size()*sizeof(T), dir), values((T*) file.get()){
+    if(value != T())
+      std::fill(values, values + layout.size(), value);
+  }
+  
+  T& operator[](size_t i){ return values[layout(i)]; }
+};
+
+// Bit flags in memory (bit_grid) and in a mapped file, in blocks
+class memory_bit_grid : public bit_grid{
+public:
+  memory_bit_grid(const grid& g, const string&): bit_grid(g){}
+};
+
+class mapped_bit_grid{
+  block_layout layout;
+  mapped_file file;
+  uint64_t* bits;
+public:
+  mapped_bit_grid(const grid& g, const string& dir): layout(g), file(layout.size()/8, dir), bits((uint64_t*) file.get()){}
+  
+  bool operator[](size_t i) const { size_t p = layout(i); return (bits[p >> 6] >> (p & 63)) & 1; }
+  void set(size_t i){ size_t p = layout(i); bits[p >> 6] |= (uint64_t) 1 << (p & 63); }
+};
+
+// Kinds of scratch grids, kernels are templated on these
+struct memory_scratch{
+  template <typename T> using values = memory_grid<T>;
+  typedef memory_bit_grid bits;
+};
+
+struct mapped_scratch{
+  template <typename T> using values = mapped_grid<T>;
+  typedef mapped_bit_grid bits;
+};
+
+// Helper function for determining d8 flow directions of edge cells (RichDEM), flow is directed off the DEM
+static int d8_edge_flowdir(const int r, const int c, const int nrow, const int ncol){
+  
+  if(r==0 && c==0)
+    return 2;
+  else if(r == nrow-1 && c == 0)
+    return 8;
+  else if(r == 0 && c == ncol-1)
+    return 4;
+  else if(r == nrow-1 && c == ncol-1)
+    return 6;
+  else if(c == 0)
+    return 1;
+  else if(c == ncol-1)
+    return 5;
+  else if(r == 0)
+    return 3;
+  else
+    return 7;
+}
+
+// Counters and phase timings of the priority-flood and breaching kernels, returned as attribute "stats" of the result on request
+// The counters are cheap enough to always be kept, breach paths are only timed when enabled
+class kernel_stats{
+public:
+  bool enabled;
+  size_t pushes = 0;          // Cells pushed to the open and pit queues
+  size_t max_open = 0;        // Largest size of the open queue
+  size_t max_pit = 0;         // Largest size of the pit queue
+  size_t pit_cells = 0;       // Cells taken from the pit queue, or pits found when breaching or building the depression hierarchy
+  size_t raised_cells = 0;    // Cells raised by filling
+  size_t lowered_cells = 0;   // Cells lowered by breaching
+  size_t false_pit_cells = 0; // Cells raised above their surroundings by epsilon filling
+  size_t unbreached_pits = 0; // Pits not breached within the limits of constrained breaching
+  size_t traces = 0;          // Breach paths traced
+  size_t trace_cells = 0;     // Cells on breach paths
+  size_t max_trace = 0;       // Longest breach path
+  double setup_seconds = 0;   // Choosing and allocating the queues and scratch grids
+  double seed_seconds = 0;    // Seeding the queue with edge cells or pits
+  double flood_seconds = 0;   // Emptying the queues, including breach paths
+  double trace_seconds = 0;   // Tracing breach paths
+  
+  kernel_stats(bool enabled) : enabled(enabled), last(chrono::steady_clock::now()) {}
+  
+  // Seconds since the previous lap or construction
+  double lap(){
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(now - last).count();
+    last = now;
+    return seconds;
+  }
+  
+  void queues(size_t open, size_t pit){
+    max_open = max(max_open, open);
+    max_pit = max(max_pit, pit);
+  }
+  
+  void trace(size_t cells, double seconds){
+    traces++;
+    trace_cells += cells;
+    max_trace = max(max_trace, cells);
+    trace_seconds += seconds;
+  }
+  
+  List list() const{
+    return List::create(_["setup_seconds"] = setup_seconds, _["seed_seconds"] = seed_seconds, _["flood_seconds"] = flood_seconds, _["trace_seconds"] = trace_seconds,
+                        _["pushes"] = (double) pushes, _["max_open"] = (double) max_open, _["max_pit"] = (double) max_pit,
+                        _["pit_cells"] = (double) pit_cells, _["raised_cells"] = (double) raised_cells, _["lowered_cells"] = (double) lowered_cells,
+                        _["false_pit_cells"] = (double) false_pit_cells, _["unbreached_pits"] = (double) unbreached_pits, _["traces"] = (double) traces, 
+                        _["trace_cells"] = (double) trace_cells, _["max_trace"] = (double) max_trace);
+  }
+  
+private:
+  chrono::steady_clock::time_point last;
+};
+
+// Attaches the statistics of a kernel run to its result when requested
+template <typename R>
+static R with_stats(R result, const kernel_stats& st, bool stats){
+  if(stats)
+    result.attr("stats") = st.list();
+  return result;
+}
+
+// Kernels changing the DEM in place run on a copy when statistics are requested, so the statistics are attached to the 
+// result and not to the matrix of the caller
+template <int RTYPE>
+static Matrix<RTYPE> stats_result(Matrix<RTYPE> dem, bool stats){
+  return stats ? clone(dem) : dem;
+}
+
 // Depressions
 
-//' Improved priority flood (algorithm 2) in:
-//' "Barnes, R., Lehman, C., Mulla, D., 2014. Priority-flood: An optimal depression-filling and watershed-labeling algorithm for digital elevation models. Computers & Geosciences 62, 117–127. doi:10.1016/j.cageo.2013.04.024"
-//'
-//' @param dem The input digital elevation model (DEM)
-//' @return The DEM with depressions removed
-// [[Rcpp::export]]
-NumericMatrix pf_barnes2014(NumericMatrix dem){
+template <typename T, template <typename> class Q>
+static void pf_barnes2014_q(matrix_view<T> dem, kernel_stats& st){
 
-  priority_queue<cellz, vector<cellz>, greater<cellz>> open;
-  queue<cellz> pit;
-  LogicalMatrix closed(dem.nrow(), dem.ncol());
+  Q<T> open(dem.begin(), dem.nrow(), dem.ncol());
+  queue<cellz<T>> pit;
+  grid g(dem.nrow(), dem.ncol());
+  bit_grid closed(g);
 
+  st.setup_seconds = st.lap();
+  
   // Add edge cells to priority queue
   // Horizontal edges
   for(int x = 0; x < dem.ncol(); x++){
-    open.push(cellz(0, x, dem(0, x)));
-    open.push(cellz(dem.nrow()-1, x, dem(dem.nrow()-1, x)));
-    closed(0, x) = true;
-    closed(dem.nrow()-1, x) = true;
+    open.push(cellz<T>(0, x, elevation(dem(0, x))));
+    open.push(cellz<T>(dem.nrow()-1, x, elevation(dem(dem.nrow()-1, x))));
+    closed.set(g.index(0, x));
+    closed.set(g.index(dem.nrow()-1, x));
   }
   
   // Vertical edges
   for(int y = 0; y < dem.nrow(); y++){
-    open.push(cellz(y, 0, dem(y, 0)));
-    open.push(cellz(y, dem.ncol()-1, dem(y, dem.ncol()-1)));
-    closed(y, 0) = true;
-    closed(y, dem.ncol()-1) = true;
+    open.push(cellz<T>(y, 0, elevation(dem(y, 0))));
+    open.push(cellz<T>(y, dem.ncol()-1, elevation(dem(y, dem.ncol()-1))));
+    closed.set(g.index(y, 0));
+    closed.set(g.index(y, dem.ncol()-1));
   }
   
+  st.pushes += open.size();
+  st.seed_seconds = st.lap();
+  
   while(open.size()>0 || pit.size()>0){
-    cellz c;
+    cellz<T> c;
+    st.queues(open.size(), pit.size());
     if(pit.size()>0){
       c = pit.front();
       pit.pop();
+      st.pit_cells++;
     } else {
       c=open.top();
       open.pop();
     }
 
+    size_t i = g.index(c.r, c.c);
+    
     for(int n=1; n<=8; n++){
       int nc=c.c+dx[n];
       int nr=c.r+dy[n];
-      if(!(0<=nc && nc<dem.ncol() && 0<=nr && nr<dem.nrow())) 
+      if(!g.inside(nr, nc))
         continue;
-      if(closed(nr,nc))
+      
+      size_t ni = i + g.offset[n];
+      
+      if(closed[ni])
         continue;
       
-      closed(nr,nc) = true;
+      closed.set(ni);
       
-      if(dem(nr,nc) <= c.z){
+      if(elevation(dem[ni]) <= c.z){
         
-        if(dem(nr,nc) < c.z){
+        if(!is_nodata(dem[ni])){
           
-          dem(nr,nc) = c.z;
+          st.raised_cells += dem[ni] < c.z;
+          dem[ni] = c.z;
           
         }
         
-        pit.push(cellz(nr,nc,c.z));
+        pit.push(cellz<T>(nr,nc,c.z));
+        st.pushes++;
         
       } else {
-        open.push(cellz(nr, nc, dem(nr, nc)));
+        open.push(cellz<T>(nr, nc, dem[ni]));
+        st.pushes++;
         }
       }
     }
   
-  return(dem);
+  st.flood_seconds = st.lap();
+}
+
+// Runs pf_barnes2014_q with the queue named by queue
+template <int RTYPE>
+static Matrix<RTYPE> pf_barnes2014_t(Matrix<RTYPE> dem, string queue, bool stats){
+  
+  dem = stats_result(dem, stats);
+  kernel_stats st(stats);
+  queue = open_queue(dem.begin(), dem.size(), queue);
   
+  typedef typename traits::storage_type<RTYPE>::type T;
+  matrix_view<T> z(dem);
+  
+  if(queue == "bucket")
+    pf_barnes2014_q<T, bucket_queue>(z, st);
+  else if(queue == "dary")
+    pf_barnes2014_q<T, dary_queue>(z, st);
+  else
+    pf_barnes2014_q<T, heap_queue>(z, st);
+  
+  return with_stats(dem, st, stats);
 }
 
-//' Improved priority flood (algorithm 3) in:
+//' Improved priority flood (algorithm 2) in:
 //' "Barnes, R., Lehman, C., Mulla, D., 2014. Priority-flood: An optimal depression-filling and watershed-labeling algorithm for digital elevation models. Computers & Geosciences 62, 117–127. doi:10.1016/j.cageo.2013.04.024"
 //'
-//' @param dem The input digital elevation model (DEM)
+//' @param dem The input digital elevation model (DEM), an integer or double matrix
+//' @param queue The open set of the priority flood: 'heap' (binary heap, default), 'dary' (4-ary heap), 'bucket' (bucket queue, integer DEMs only) or 'auto'
+//' @param stats Attach statistics of the run (phase times, queue pushes and sizes, pit and raised cells) as attribute 'stats' of the result, which is then a copy of dem
 //' @return The DEM with depressions removed
 // [[Rcpp::export]]
-NumericMatrix pf_eps_barnes2014(NumericMatrix dem){
+SEXP pf_barnes2014(SEXP dem, std::string queue = "heap", bool stats = false){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return pf_barnes2014_t<INTSXP>(dem, queue, stats);
+  case REALSXP:
+    return pf_barnes2014_t<REALSXP>(dem, queue, stats);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
+
+static void pf_eps_barnes2014_q(matrix_view<double> dem, kernel_stats& st){
 
-  priority_queue<cellz, vector<cellz>, greater<cellz>> open;
-  queue<cellz> pit;
-  LogicalMatrix closed(dem.nrow(), dem.ncol());
-  double pittop = dem_nodata;
+  priority_queue<cellz<double>, vector<cellz<double>>, greater<cellz<double>>> open;
+  queue<cellz<double>> pit;
+  grid g(dem.nrow(), dem.ncol());
+  bit_grid closed(g);
+  double pittop = NA_REAL; // NA while no pit is being filled
   int false_pit_cells = 0;
   
+  st.setup_seconds = st.lap();
+  
   // Add edge cells to priority queue
   // Horizontal edges
   for(int x = 0; x < dem.ncol(); x++){
-    open.push(cellz(0, x, dem(0, x)));
-    open.push(cellz(dem.nrow()-1, x, dem(dem.nrow()-1, x)));
-    closed(0, x) = true;
-    closed(dem.nrow()-1, x) = true;
+    open.push(cellz<double>(0, x, elevation(dem(0, x))));
+    open.push(cellz<double>(dem.nrow()-1, x, elevation(dem(dem.nrow()-1, x))));
+    closed.set(g.index(0, x));
+    closed.set(g.index(dem.nrow()-1, x));
   }
   
   // Vertical edges
   for(int y = 0; y < dem.nrow(); y++){
-    open.push(cellz(y, 0, dem(y, 0)));
-    open.push(cellz(y, dem.ncol()-1, dem(y, dem.ncol()-1)));
-    closed(y, 0) = true;
-    closed(y, dem.ncol()-1) = true;
+    open.push(cellz<double>(y, 0, elevation(dem(y, 0))));
+    open.push(cellz<double>(y, dem.ncol()-1, elevation(dem(y, dem.ncol()-1))));
+    closed.set(g.index(y, 0));
+    closed.set(g.index(y, dem.ncol()-1));
   }
   
+  st.pushes += open.size();
+  st.seed_seconds = st.lap();
+  
   while(open.size()>0 || pit.size()>0){
-    cellz c;
+    cellz<double> c;
+    st.queues(open.size(), pit.size());
     
     if(pit.size()>0 && open.size()>0 && open.top().z == pit.front().z){
       c = open.top();
       open.pop();
-      pittop = dem_nodata;
+      pittop = NA_REAL;
     } else if(pit.size()>0){
       c=pit.front();
       pit.pop();
-      if(pittop == dem_nodata)
-        pittop = dem(c.r,c.c);
+      st.pit_cells++;
+      if(ISNAN(pittop) && !is_nodata(dem(c.r, c.c)))
+        pittop = c.z;
     } else {
       c=open.top();
       open.pop();
-      pittop= dem_nodata;
+      pittop = NA_REAL;
     }
     
+    size_t i = g.index(c.r, c.c);
+    
     for(int n=1; n<=8; n++){
       
       int nc=c.c+dx[n];
       int nr=c.r+dy[n];
       
-      if(!(0<=nc && nc<dem.ncol() && 0<=nr && nr<dem.nrow())) 
+      if(!g.inside(nr, nc))
         continue;
       
-      if(closed(nr,nc))
+      size_t ni = i + g.offset[n];
+      
+      if(closed[ni])
         continue;
       
-      closed(nr,nc) = true;
+      closed.set(ni);
       
-      if(dem(nr,nc) == dem_nodata){
-        pit.push(cellz(nr, nc, dem_nodata));
+      if(is_nodata(dem[ni])){
+        pit.push(cellz<double>(nr, nc, elevation(dem[ni])));
       }
       
-      else if(dem(nr, nc) <= nextafter(c.z, numeric_limits<double>::infinity())){
-        if(pittop != dem_nodata && pittop < dem(nr,nc) && nextafter(c.z, numeric_limits<double>::infinity()) >= dem(nr,nc))
+      else if(dem[ni] <= nextafter(c.z, numeric_limits<double>::infinity())){
+        if(!ISNAN(pittop) && pittop < dem[ni] && nextafter(c.z, numeric_limits<double>::infinity()) >= dem[ni])
           ++false_pit_cells;
-        dem(nr,nc) = nextafter(c.z, numeric_limits<double>::infinity());
-        pit.push(cellz(nr, nc, dem(nr, nc)));
+        st.raised_cells += dem[ni] < nextafter(c.z, numeric_limits<double>::infinity());
+        dem[ni] = nextafter(c.z, numeric_limits<double>::infinity());
+        pit.push(cellz<double>(nr, nc, dem[ni]));
       } else
-        open.push(cellz(nr, nc, dem(nr, nc)));
+        open.push(cellz<double>(nr, nc, dem[ni]));
+      st.pushes++;
     }
   }
   
-  if(false_pit_cells){
-    Rcout<<"Warning: While raising elevation of depression cells. Elevation for " <<false_pit_cells<< "  cells were increased above that of surrounding cells." << std::endl;
-  }
-  
-  return(dem);
+  st.flood_seconds = st.lap();
+  st.false_pit_cells = false_pit_cells;
 }
 
-//' Improved priority flood with watershed labels (algorithm 5) in:
+//' Improved priority flood (algorithm 3) in:
 //' "Barnes, R., Lehman, C., Mulla, D., 2014. Priority-flood: An optimal depression-filling and watershed-labeling algorithm for digital elevation models. Computers & Geosciences 62, 117–127. doi:10.1016/j.cageo.2013.04.024"
 //'
 //' @param dem The input digital elevation model (DEM)
-//' @return List of two rasters: one with the filled input dem and one integer raster with basin labels
+//' @param stats Attach statistics of the run (phase times, queue pushes and sizes, pit, raised and false pit cells) as attribute 'stats' of the result, which is then a copy of dem
+//' @return The DEM with depressions removed
 // [[Rcpp::export]]
-List pf_basins_barnes2014(NumericMatrix dem){
+NumericMatrix pf_eps_barnes2014(NumericMatrix dem, bool stats = false){
+  
+  dem = stats_result(dem, stats);
+  kernel_stats st(stats);
+  pf_eps_barnes2014_q(matrix_view<double>(dem), st);
+  
+  if(st.false_pit_cells){
+    Rcout<<"Warning: While raising elevation of depression cells. Elevation for " <<st.false_pit_cells<< "  cells were increased above that of surrounding cells." << std::endl;
+  }
+  
+  return with_stats(dem, st, stats);
+}
+
+template <int RTYPE, template <typename> class Q, class S>
+static List pf_basins_barnes2014_q(Matrix<RTYPE> dem, kernel_stats& st, const string& scratch_dir){
+
+  typedef typename traits::storage_type<RTYPE>::type T;
 
-  priority_queue<cellz, vector<cellz>, greater<cellz>> open;
-  queue<cellz> pit;
-  LogicalMatrix closed(dem.nrow(), dem.ncol());
+  Q<T> open(dem.begin(), dem.nrow(), dem.ncol());
+  queue<cellz<T>> pit;
+  grid g(dem.nrow(), dem.ncol());
+  typename S::bits closed(g, scratch_dir);
   IntegerMatrix labels(dem.nrow(), dem.ncol());
   
   int labels_nodata = 0;
   int clabel = 1;
   
+  st.setup_seconds = st.lap();
+  
   // Add edge cells to priority queue
   // Horizontal edges
   for(int x = 0; x < dem.ncol(); x++){
-    open.push(cellz(0, x, dem(0, x)));
-    open.push(cellz(dem.nrow()-1, x, dem(dem.nrow()-1, x)));
-    closed(0, x) = true;
-    closed(dem.nrow()-1, x) = true;
+    open.push(cellz<T>(0, x, elevation(dem(0, x))));
+    open.push(cellz<T>(dem.nrow()-1, x, elevation(dem(dem.nrow()-1, x))));
+    closed.set(g.index(0, x));
+    closed.set(g.index(dem.nrow()-1, x));
   }
   
   // Vertical edges
   for(int y = 0; y < dem.nrow(); y++){
-    open.push(cellz(y, 0, dem(y, 0)));
-    open.push(cellz(y, dem.ncol()-1, dem(y, dem.ncol()-1)));
-    closed(y, 0) = true;
-    closed(y, dem.ncol()-1) = true;
+    open.push(cellz<T>(y, 0, elevation(dem(y, 0))));
+    open.push(cellz<T>(y, dem.ncol()-1, elevation(dem(y, dem.ncol()-1))));
+    closed.set(g.index(y, 0));
+    closed.set(g.index(y, dem.ncol()-1));
   }
   
+  st.pushes += open.size();
+  st.seed_seconds = st.lap();
+  
   while(open.size()>0 || pit.size()>0){
-    cellz c;
+    cellz<T> c;
+    st.queues(open.size(), pit.size());
     if(pit.size()>0){
       c = pit.front();
       pit.pop();
+      st.pit_cells++;
     } else {
       c=open.top();
       open.pop();
     }
     
-    if(labels(c.r,c.c) == labels_nodata && dem(c.r,c.c) != dem_nodata){
-      labels(c.r,c.c) = clabel++;
+    size_t i = g.index(c.r, c.c);
+    
+    if(labels[i] == labels_nodata && !is_nodata(dem[i])){
+      labels[i] = clabel++;
       }
       
     for(int n=1; n<=8; n++){
       int nc=c.c+dx[n];
       int nr=c.r+dy[n];
-      if(!(0<=nc && nc<dem.ncol() && 0<=nr && nr<dem.nrow())) 
+      if(!g.inside(nr, nc))
         continue;
-      if(closed(nr,nc))
+      
+      size_t ni = i + g.offset[n];
+      
+      if(closed[ni])
         continue;
       
-      labels(nr,nc) = labels(c.r,c.c);
+      labels[ni] = labels[i];
       
-      closed(nr,nc) = true;
+      closed.set(ni);
       
-      if(dem(nr,nc) <= c.z){
+      if(elevation(dem[ni]) <= c.z){
         
-        if(dem(nr,nc) < c.z){
+        if(!is_nodata(dem[ni])){
           
-          dem(nr,nc) = c.z;
+          st.raised_cells += dem[ni] < c.z;
+          dem[ni] = c.z;
           
         }
         
-        pit.push(cellz(nr,nc,c.z));
+        pit.push(cellz<T>(nr,nc,c.z));
+        st.pushes++;
         
       } else {
         
-        open.push(cellz(nr, nc, dem(nr, nc)));
+        open.push(cellz<T>(nr, nc, dem[ni]));
+        st.pushes++;
         
       }
     }
   }
   
+  st.flood_seconds = st.lap();
+  
   List result = List::create(_["dem"] = dem, _["labels"] = labels);
   
   return(result);
   
 }
 
-// Utility functions to get single index from [row, col] subscript and vice versa
-int rc_to_i(const int row, const int col, NumericMatrix m){
-  
-  assert(0<=col && col<m.ncol() && 0<=row && row<m.nrow());
-  
-  int i = col*m.nrow()+row;
+// Runs pf_basins_barnes2014_q with the queue named by queue and scratch grids of kind S
+template <int RTYPE, class S>
+static List pf_basins_barnes2014_s(Matrix<RTYPE> dem, const string& queue, kernel_stats& st, const string& scratch_dir){
   
-  return i;
+  if(queue == "bucket")
+    return pf_basins_barnes2014_q<RTYPE, bucket_queue, S>(dem, st, scratch_dir);
+  else if(queue == "dary")
+    return pf_basins_barnes2014_q<RTYPE, dary_queue, S>(dem, st, scratch_dir);
+  else
+    return pf_basins_barnes2014_q<RTYPE, heap_queue, S>(dem, st, scratch_dir);
 }
 
-int i_to_r(const int i, NumericMatrix m){
-  int row = i % m.nrow();
-  return row;
-}
-
-int i_to_c(const int i, NumericMatrix m){
-  int col = i / m.nrow();
-  return col;
+template <int RTYPE>
+static List pf_basins_barnes2014_t(Matrix<RTYPE> dem, string queue, bool stats, string scratch_dir){
+  
+  kernel_stats st(stats);
+  queue = open_queue(dem.begin(), dem.size(), queue);
+  
+  if(scratch_dir.empty())
+    return with_stats(pf_basins_barnes2014_s<RTYPE, memory_scratch>(dem, queue, st, scratch_dir), st, stats);
+  else
+    return with_stats(pf_basins_barnes2014_s<RTYPE, mapped_scratch>(dem, queue, st, scratch_dir), st, stats);
 }
 
-//' Complete breaching algorithm:
-//' "Lindsay, J.B., 2016. Efficient hybrid breaching-filling sink removal methods for flow path enforcement in digital elevation models: Efficient Hybrid Sink Removal Methods for Flow Path Enforcement. Hydrological Processes 30, 846--857. doi:10.1002/hyp.10648"
-//' As implemented in RichDEM
+//' Improved priority flood with watershed labels (algorithm 5) in:
+//' "Barnes, R., Lehman, C., Mulla, D., 2014. Priority-flood: An optimal depression-filling and watershed-labeling algorithm for digital elevation models. Computers & Geosciences 62, 117–127. doi:10.1016/j.cageo.2013.04.024"
 //'
-//' @param dem The input digital elevation model (DEM)
-//' @return The DEM with depressions breached
+//' @param dem The input digital elevation model (DEM), an integer or double matrix
+//' @param queue The open set of the priority flood: 'heap' (binary heap, default), 'dary' (4-ary heap), 'bucket' (bucket queue, integer DEMs only) or 'auto'
+//' @param stats Attach statistics of the run (phase times, queue pushes and sizes, pit and raised cells) as attribute 'stats'
+//' @param scratch_dir Directory for memory-mapped scratch grids, or "" (default) to keep them in memory
+//' @return List of two rasters: one with the filled input dem and one integer raster with basin labels
 // [[Rcpp::export]]
-NumericMatrix comp_breach_lindsay2016(NumericMatrix dem){
+SEXP pf_basins_barnes2014(SEXP dem, std::string queue = "heap", bool stats = false, std::string scratch_dir = ""){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return pf_basins_barnes2014_t<INTSXP>(dem, queue, stats, scratch_dir);
+  case REALSXP:
+    return pf_basins_barnes2014_t<REALSXP>(dem, queue, stats, scratch_dir);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
 
-  int NO_BACK_LINK = numeric_limits<int>::max();
+template <int RTYPE, template <typename> class Q>
+static List pf_flowdirs_barnes2014_q(Matrix<RTYPE> dem, kernel_stats& st){
   
-  int UNVISITED = 0;
-  int VISITED = 1;
-  int EDGE = 2;
+  typedef typename traits::storage_type<RTYPE>::type T;
   
-  IntegerMatrix backlinks(dem.nrow(), dem.ncol());
-  fill(backlinks.begin(), backlinks.end(), NO_BACK_LINK);
-  IntegerMatrix visited(dem.nrow(), dem.ncol());
-  LogicalMatrix pits(dem.nrow(), dem.ncol());
+  Q<T> open(dem.begin(), dem.nrow(), dem.ncol());
+  queue<cellz<T>> pit;
+  grid g(dem.nrow(), dem.ncol());
+  bit_grid closed(g);
+  IntegerMatrix flowdirs(dem.nrow(), dem.ncol());
   
-  int total_pits = 0;
-  priority_queue<cellz, vector<cellz>, greater<cellz>> pq; // Slightly different queue used in RichDEM
+  st.setup_seconds = st.lap();
   
-  //Seed the priority queue
-  for(int r = 0; r < dem.nrow(); r++){
-    for(int c = 0; c < dem.ncol(); c++){
-      
-      if(dem(r, c) == dem_nodata)
-        continue;
-      
-      if(r==0 || c==0 || c == dem.ncol()-1 || r == dem.nrow()-1){
-        pq.push(cellz(r, c, dem(r, c)));
-        visited(r, c) = EDGE;
-        continue;
-      }
-      
-      double lowest_neighbour = numeric_limits<double>::max();
-      for(int n = 1; n <= 8; n++){
-        const int nc = c+dx[n];
-        const int nr = r+dy[n];
-        
-        if(dem(nr, nc) == dem_nodata){
-          pq.push(cellz(r, c, dem(r, c)));
-          visited(r, c) = EDGE;
-          goto nextcell;
-        }
-        
-        lowest_neighbour = min(dem(nr, nc), lowest_neighbour);
-      }
-      
-      if(dem(r, c) <= lowest_neighbour){
-        dem(r, c) = lowest_neighbour;
-        pits(r, c) = true;
-        total_pits++;
-      }
-      
-      nextcell:;
-    }
+  // Add edge cells to priority queue, flow is directed off the DEM
+  // Horizontal edges
+  for(int x = 0; x < dem.ncol(); x++){
+    open.push(cellz<T>(0, x, elevation(dem(0, x))));
+    open.push(cellz<T>(dem.nrow()-1, x, elevation(dem(dem.nrow()-1, x))));
+    closed.set(g.index(0, x));
+    closed.set(g.index(dem.nrow()-1, x));
+    flowdirs(0, x) = is_nodata(dem(0, x)) ? flowdir_nodata : d8_edge_flowdir(0, x, dem.nrow(), dem.ncol());
+    flowdirs(dem.nrow()-1, x) = is_nodata(dem(dem.nrow()-1, x)) ? flowdir_nodata : d8_edge_flowdir(dem.nrow()-1, x, dem.nrow(), dem.ncol());
   }
   
-  while(!pq.empty()){
-    
-    const cellz c = pq.top();
-    pq.pop();
-    
-    if(pits(c.r,c.c)){
-      
-      //Locate a cell that is lower than the pit cell, or an edge cell
-      int cc = rc_to_i(c.r, c.c, dem);
-      int cc_r = i_to_r(cc, dem);
-      int cc_c = i_to_c(cc, dem);
-      double target_height = dem(c.r,c.c);
-      
-      //Trace path back to a cell low enough for the path to drain into it, or
-      //to an edge of the DEM
-      while(cc != NO_BACK_LINK && dem(cc_r, cc_c) >= target_height){
-        dem(cc_r, cc_c) = target_height;
-        cc = backlinks(cc_r, cc_c);
-        cc_r = i_to_r(cc, dem);
-        cc_c = i_to_c(cc, dem);
-      }
-      
-      --total_pits;
-      
-      if(total_pits==0)
-        break;
+  // Vertical edges
+  for(int y = 0; y < dem.nrow(); y++){
+    open.push(cellz<T>(y, 0, elevation(dem(y, 0))));
+    open.push(cellz<T>(y, dem.ncol()-1, elevation(dem(y, dem.ncol()-1))));
+    closed.set(g.index(y, 0));
+    closed.set(g.index(y, dem.ncol()-1));
+    flowdirs(y, 0) = is_nodata(dem(y, 0)) ? flowdir_nodata : d8_edge_flowdir(y, 0, dem.nrow(), dem.ncol());
+    flowdirs(y, dem.ncol()-1) = is_nodata(dem(y, dem.ncol()-1)) ? flowdir_nodata : d8_edge_flowdir(y, dem.ncol()-1, dem.nrow(), dem.ncol());
+  }
+  
+  st.pushes += open.size();
+  st.seed_seconds = st.lap();
+  
+  while(open.size()>0 || pit.size()>0){
+    cellz<T> c;
+    st.queues(open.size(), pit.size());
+    if(pit.size()>0){
+      c = pit.front();
+      pit.pop();
+      st.pit_cells++;
+    } else {
+      c=open.top();
+      open.pop();
     }
     
-    //Looks for neighbours which are either unvisited or pits
-    for(int n = 1; n <= 8; n++){
-      const int nc = c.c+dx[n];
-      const int nr = c.r+dy[n];
-      
-      if(!(0<=nc && nc<dem.ncol() && 0<=nr && nr<dem.nrow()))
+    size_t i = g.index(c.r, c.c);
+    
+    for(int n=1; n<=8; n++){
+      int nc=c.c+dx[n];
+      int nr=c.r+dy[n];
+      if(!g.inside(nr, nc))
         continue;
       
-      if(dem(nr, nc) == dem_nodata)
-        continue;
+      size_t ni = i + g.offset[n];
       
-      if(visited(nr, nc) != UNVISITED)
+      if(closed[ni])
         continue;
       
-      double my_e = dem(nr, nc);
+      closed.set(ni);
+      
+      // The neighbour drains to the cell it is flooded from
+      flowdirs[ni] = is_nodata(dem[ni]) ? flowdir_nodata : d8_inv[n];
       
-      pq.push(cellz(nr, nc, my_e));
-      visited(nr, nc) = VISITED;
-      backlinks(nr, nc) = rc_to_i(c.r, c.c, dem);
+      if(elevation(dem[ni]) <= c.z){
+        if(!is_nodata(dem[ni])){
+          st.raised_cells += dem[ni] < c.z;
+          dem[ni] = c.z;
+        }
+        pit.push(cellz<T>(nr,nc,c.z));
+      } else {
+        open.push(cellz<T>(nr, nc, dem[ni]));
+      }
+      st.pushes++;
     }
   }
   
-  return dem;
-}
-
-// Flow directions
-
-// Helper function for determining d8 flow directions (RichDEM)
-static int d8_flowdir(NumericMatrix dem, const int r, const int c){
-  
-  double minimum_elevation = dem(r, c);
-  int flowdir = 0;
+  st.flood_seconds = st.lap();
   
-  // Flow direction for edge cells
-  if (r==0 || c==0 || c == dem.ncol()-1 || r == dem.nrow()-1){
-    if(r==0 && c==0)
-      return 2;
-    else if(r == dem.nrow()-1 && c == 0)
-      return 8;
-    else if(r == 0 && c == dem.ncol()-1)
-      return 4;
-    else if(r == dem.nrow()-1 && c == dem.ncol()-1)
-      return 6;
-    else if(c == 0)
-      return 1;
-    else if(c == dem.ncol()-1)
-      return 5;
-    else if(r == 0)
-      return 3;
-    else if(r == dem.nrow()-1)
-      return 7;
-  }
+  List result = List::create(_["dem"] = dem, _["flowdirs"] = flowdirs);
   
-  // Flow direction for all other cells
-  for(int n=1; n<=8; n++){
-    if(dem(r+dy[n], c+dx[n]) < minimum_elevation || (dem(r+dy[n], c+dx[n]) == minimum_elevation && flowdir>0 && flowdir%2==0 && n%2==1)){
-      minimum_elevation = dem(r+dy[n], c+dx[n]);
-      flowdir = n;
-    }
-  }
+  return(result);
+}
+
+// Runs pf_flowdirs_barnes2014_q with the queue named by queue
+template <int RTYPE>
+static List pf_flowdirs_barnes2014_t(Matrix<RTYPE> dem, string queue, bool stats){
   
-  return flowdir;
+  kernel_stats st(stats);
+  queue = open_queue(dem.begin(), dem.size(), queue);
   
+  if(queue == "bucket")
+    return with_stats(pf_flowdirs_barnes2014_q<RTYPE, bucket_queue>(dem, st), st, stats);
+  else if(queue == "dary")
+    return with_stats(pf_flowdirs_barnes2014_q<RTYPE, dary_queue>(dem, st), st, stats);
+  else
+    return with_stats(pf_flowdirs_barnes2014_q<RTYPE, heap_queue>(dem, st), st, stats);
 }
 
-//' Function for determining d8 flow directions (RichDEM)
+//' Priority flood with flow directions (algorithm 4) in:
+//' "Barnes, R., Lehman, C., Mulla, D., 2014. Priority-flood: An optimal depression-filling and watershed-labeling algorithm for digital elevation models. Computers & Geosciences 62, 117–127. doi:10.1016/j.cageo.2013.04.024"
 //'
-//' @param dem The input digital elevation model (DEM)
-//' @return a d8 flow direction raster
+//' Each cell is given the d8 flow direction towards the cell it is flooded from, so flat and filled areas drain without an epsilon gradient.
+//' The filled DEM is identical to pf_barnes2014.
+//'
+//' @param dem The input digital elevation model (DEM), an integer or double matrix
+//' @param queue The open set of the priority flood: 'heap' (binary heap, default), 'dary' (4-ary heap), 'bucket' (bucket queue, integer DEMs only) or 'auto'
+//' @param stats Attach statistics of the run (phase times, queue pushes and sizes, pit and raised cells) as attribute 'stats'
+//' @return List of two rasters: the filled input dem and the d8 flow directions
 // [[Rcpp::export]]
-IntegerMatrix d8_flow_directions(NumericMatrix dem){
-
-  IntegerMatrix flowdirs(dem.nrow(), dem.ncol());
-
-  // For potential parallel solution see https://mfasiolo.github.io/sc2-2019/rcpp_advanced_iii/2_rcppparallel/
-  for(int r=0; r < dem.nrow(); r++){
-    for(int c=0; c < dem.ncol(); c++)
-      if(dem(r, c) == dem_nodata)
-        flowdirs(r, c) = flowdir_nodata;
-      else
-        flowdirs(r, c) = d8_flowdir(dem, r, c);
+SEXP pf_flowdirs_barnes2014(SEXP dem, std::string queue = "heap", bool stats = false){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return pf_flowdirs_barnes2014_t<INTSXP>(dem, queue, stats);
+  case REALSXP:
+    return pf_flowdirs_barnes2014_t<REALSXP>(dem, queue, stats);
+  default:
+    stop("dem must be an integer or double matrix");
   }
-  
-  return flowdirs;
 }
 
-//' Function for determining d8 flow accumulation (RichDEM)
-//'
-//' @param flowdirs The d8 pointer flow direction raster
-//' @return a flow accumulation raster
-// [[Rcpp::export]]
-NumericMatrix d8_flow_accum(IntegerMatrix flowdirs){
+// Depression hierarchy
+
+// Depression in the hierarchy, a pit or depressions merged at a spill elevation
+template <typename T>
+struct depression {
+  int parent = 0;       // Depression it merges into when full, 0 if it spills to the edge
+  int spill_to = -1;    // Pit across the spill point, 0 for the edge
+  long spill_cell = -1;
+  T spill = 0;
+  T merge = 0;          // Elevation the children merge at, for depressions of several pits
+  bool merged = false;
+  long pit_cell = -1;   // Lowest cell below the spill elevation
+  T pit = 0;
+  double cells = 0;     // Cells below the spill elevation and their summed elevation
+  double sum_z = 0;
+};
+
+// Lowest pass between two pits, cell_a is on the side of the first pit
+template <typename T>
+struct depression_outlet {
+  T z;
+  size_t cell_a, cell_b;
+};
+
+// Priority flood from the edges and from every cell without a lower neighbour, without raising the DEM. Each cell is labelled 
+// with the pit it drains to (0 for the edges) and the lowest pass between each pair of adjacent pits is kept. The passes are 
+// then taken in order of elevation: pits meeting at a pass merge into a new depression, and a depression meeting the edges 
+// spills there. The DEM is filled to the spill elevation of the outermost depressions, which is the same as pf_barnes2014.
+template <int RTYPE, template <typename> class Q>
+static List pf_depressions_barnes2020_q(Matrix<RTYPE> dem, kernel_stats& st){
   
-  std::queue<cell> sources;
+  typedef typename traits::storage_type<RTYPE>::type T;
   
-  NumericMatrix dependency(flowdirs.nrow(), flowdirs.ncol());
-  NumericMatrix area(flowdirs.nrow(), flowdirs.ncol());
-  double area_nodata = -1;
+  Q<T> open(dem.begin(), dem.nrow(), dem.ncol());
+  grid g(dem.nrow(), dem.ncol());
+  bit_grid done(g);
+  IntegerMatrix labels(dem.nrow(), dem.ncol());
+  std::fill(labels.begin(), labels.end(), -1);
+  
+  st.setup_seconds = st.lap();
+  
+  // Edge cells drain to the edge, label 0
+  for(int x = 0; x < g.ncol; x++){
+    for(int y : {0, g.nrow-1}){
+      labels(y, x) = 0;
+      open.push(cellz<T>(y, x, elevation(dem(y, x))));
+    }
+  }
+  
+  for(int y = 1; y < g.nrow-1; y++){
+    for(int x : {0, g.ncol-1}){
+      labels(y, x) = 0;
+      open.push(cellz<T>(y, x, elevation(dem(y, x))));
+    }
+  }
   
-  for(int r = 0; r<flowdirs.nrow(); r++){
-    for(int c = 0; c<flowdirs.ncol(); c++){
-      if(flowdirs(r, c) == flowdir_nodata){
-        area(r,c) = area_nodata;
+  // Cells without a lower neighbour, cells in flat pits are labelled together when the first of them is reached. Interior nodata 
+  // cells are not pits and are flooded at the elevation of the cell they are reached from, as in pf_barnes2014
+  for(int x = 1; x < g.ncol-1; x++){
+    for(int y = 1; y < g.nrow-1; y++){
+      size_t i = g.index(y, x);
+      T z = dem[i];
+      if(is_nodata(z))
         continue;
-      }
-      
-      int n = flowdirs(r,c); 
-      if(n == flowdir_nodata)
+      bool pit = true;
+      for(int n = 1; n <= 8 && pit; n++)
+        pit = is_nodata(dem[i + g.offset[n]]) || dem[i + g.offset[n]] >= z;
+      if(pit)
+        open.push(cellz<T>(y, x, z));
+    }
+  }
+  
+  st.pushes += open.size();
+  st.seed_seconds = st.lap();
+  
+  vector<T> pit_z(1);
+  unordered_map<uint64_t, depression_outlet<T>> outlets;
+  
+  while(open.size()>0){
+    cellz<T> c = open.top();
+    open.pop();
+    st.queues(open.size(), 0);
+    
+    size_t i = g.index(c.r, c.c);
+    
+    if(done[i])
+      continue;
+    
+    done.set(i);
+    
+    T z = c.z;
+    
+    if(labels[i] == -1){
+      labels[i] = pit_z.size();
+      pit_z.push_back(z);
+    }
+    
+    for(int n = 1; n <= 8; n++){
+      int nc = c.c+dx[n];
+      int nr = c.r+dy[n];
+      if(!g.inside(nr, nc))
         continue;
       
-      int nc = c+dx[n];
-      int nr = r+dy[n];
+      size_t ni = i + g.offset[n];
       
-      if(!(0<=nc && nc<flowdirs.ncol() && 0<=nr && nr<flowdirs.nrow()))
-        continue;
-      
-      ++dependency(nr,nc);
+      if(labels[ni] == -1){
+        labels[ni] = labels[i];
+        open.push(cellz<T>(nr, nc, is_nodata(dem[ni]) ? z : dem[ni]));
+        st.pushes++;
+      } else if(labels[ni] != labels[i]){
+        T pass = max(z, elevation(dem[ni]));
+        bool first = labels[i] < labels[ni];
+        uint64_t key = ((uint64_t) (first ? labels[i] : labels[ni]) << 32) | (uint32_t) (first ? labels[ni] : labels[i]);
+        auto it = outlets.find(key);
+        if(it == outlets.end() || pass < it->second.z)
+          outlets[key] = {pass, first ? i : ni, first ? ni : i};
+      }
     }
   }
-
-  for(int r=0; r<flowdirs.nrow(); r++){
-    for(int c = 0; c<flowdirs.ncol(); c++){
-      if(dependency(r,c) == 0 && flowdirs(r, c) != flowdir_nodata)
-        sources.emplace(cell(r, c));
+  
+  st.flood_seconds = st.lap();
+  
+  int pits = pit_z.size()-1;
+  
+  // Passes in order of elevation, depressions are merged with a union-find over the pits, new depressions and the edge (0)
+  vector<std::pair<uint64_t, depression_outlet<T>>> passes(outlets.begin(), outlets.end());
+  outlets.clear();
+  std::sort(passes.begin(), passes.end(), [](const std::pair<uint64_t, depression_outlet<T>>& a, const std::pair<uint64_t, depression_outlet<T>>& b){
+    return a.second.z < b.second.z || (a.second.z == b.second.z && a.first < b.first);
+  });
+  
+  vector<depression<T>> dep(pits+1);
+  vector<int> root(pits+1), alias(pits+1);
+  for(int k = 0; k <= pits; k++)
+    root[k] = alias[k] = k;
+  
+  auto find = [&](int k){
+    while(root[k] != k){
+      root[k] = root[root[k]];
+      k = root[k];
     }
-  }
-      
-  long int ccount=0;
-  while(sources.size()>0){
-    cell c = sources.front();
-    sources.pop();
-    
-    ccount++;
-
-    area(c.r,c.c)++;
+    return k;
+  };
+  
+  // Depression k fills to the elevation of the pass and spills from cell a on its side to cell b
+  auto spill = [&](int k, const depression_outlet<T>& o, size_t a, size_t b){
+    dep[k].spill = o.z;
+    dep[k].spill_cell = elevation(dem[a]) >= elevation(dem[b]) ? a : b;
+    dep[k].spill_to = labels[b];
+  };
+  
+  for(auto& p : passes){
+    const depression_outlet<T>& o = p.second;
+    int a = find(labels[o.cell_a]), b = find(labels[o.cell_b]);
     
-    int n = flowdirs(c.r,c.c);
+    if(a == b)
+      continue;
     
-    if(n == flowdir_nodata)
+    // Pits on flats which drain at their own elevation are not depressions, and are joined with the pit across the pass
+    if(a <= pits && a != 0 && pit_z[a] == o.z){
+      alias[a] = labels[o.cell_b];
+      root[a] = b;
+    } else if(b <= pits && b != 0 && pit_z[b] == o.z){
+      alias[b] = labels[o.cell_a];
+      root[b] = a;
+    } else if(a == 0 || b == 0){
+      int k = a == 0 ? b : a;
+      if(a == 0)
+        spill(k, o, o.cell_b, o.cell_a);
+      else
+        spill(k, o, o.cell_a, o.cell_b);
+      root[k] = 0;
+    } else if(dep[a].merged && dep[a].merge == o.z){
+      spill(b, o, o.cell_b, o.cell_a);
+      dep[b].parent = a;
+      root[b] = a;
+    } else if(dep[b].merged && dep[b].merge == o.z){
+      spill(a, o, o.cell_a, o.cell_b);
+      dep[a].parent = b;
+      root[a] = b;
+    } else {
+      int m = dep.size();
+      dep.push_back(depression<T>());
+      root.push_back(m);
+      dep[m].merged = true;
+      dep[m].merge = o.z;
+      spill(a, o, o.cell_a, o.cell_b);
+      spill(b, o, o.cell_b, o.cell_a);
+      dep[a].parent = dep[b].parent = m;
+      root[a] = root[b] = m;
+    }
+  }
+  
+  for(int k = 1; k <= pits; k++){
+    int j = k;
+    while(alias[j] != j)
+      j = alias[j];
+    alias[k] = j;
+  }
+  
+  // Pits joined with another pit are dropped and the depressions are numbered again, pits first and depressions after their children
+  vector<int> children(dep.size()), order;
+  for(size_t k = 1; k < dep.size(); k++){
+    if(k > (size_t) pits || alias[k] == (int) k)
+      children[dep[k].parent]++;
+  }
+  for(int k = 1; k <= pits; k++){
+    if(alias[k] == k)
+      order.push_back(k);
+  }
+  for(size_t j = 0; j < order.size(); j++){
+    int p = dep[order[j]].parent;
+    if(p != 0 && --children[p] == 0)
+      order.push_back(p);
+  }
+  
+  int n = order.size();
+  vector<int> id_of(dep.size());
+  for(int j = 0; j < n; j++)
+    id_of[order[j]] = j+1;
+  
+  // Outermost depression of each pit
+  vector<int> top(pits+1);
+  for(int k = 1; k <= pits; k++){
+    top[k] = alias[k];
+    while(dep[top[k]].parent != 0)
+      top[k] = dep[top[k]].parent;
+  }
+  
+  // Cells below the spill elevation are counted in the innermost depression holding them, and the DEM is filled
+  for(size_t i = 0; i < (size_t) dem.size(); i++){
+    int k = labels[i] == 0 ? 0 : alias[labels[i]];
+    if(k == 0 || is_nodata(dem[i])){
+      labels[i] = 0;
       continue;
+    }
     
-    int nc = c.c+dx[n];
-    int nr = c.r+dy[n];
+    labels[i] = id_of[k];
     
-    if(!(0<=nc && nc<flowdirs.ncol() && 0<=nr && nr<flowdirs.nrow()))
+    T spill = dep[top[k]].spill;
+    if(dem[i] >= spill)
       continue;
     
-    if(flowdirs(nr, nc) == flowdir_nodata)
-      continue;
+    while(dem[i] >= dep[k].spill)
+      k = dep[k].parent;
     
-    area(nr,nc) += area(c.r,c.c);
-    --dependency(nr,nc);
-        
-    if(dependency(nr,nc) == 0)
-      sources.emplace(cell(nr, nc));
+    depression<T>& d = dep[k];
+    d.cells++;
+    d.sum_z += dem[i];
+    if(d.pit_cell == -1 || dem[i] < d.pit){
+      d.pit_cell = i;
+      d.pit = dem[i];
+    }
+    
+    dem[i] = spill;
+    st.raised_cells++;
   }
-
-  return area;
-
+  
+  // Totals are passed up from the pits
+  for(int k : order){
+    int p = dep[k].parent;
+    if(p == 0)
+      continue;
+    dep[p].cells += dep[k].cells;
+    dep[p].sum_z += dep[k].sum_z;
+    if(dep[k].pit_cell != -1 && (dep[p].pit_cell == -1 || dep[k].pit < dep[p].pit)){
+      dep[p].pit_cell = dep[k].pit_cell;
+      dep[p].pit = dep[k].pit;
+    }
+  }
+  
+  st.pit_cells = n;
+  
+  IntegerVector id(n), parent(n), pit_cell(n), spill_cell(n), spill_to(n);
+  NumericVector pit_elevation(n), spill_elevation(n), cells(n), volume(n), depth(n);
+  auto cell_number = [&](long i){ return i == -1 ? NA_INTEGER : g.row(i)*g.ncol + g.col(i) + 1; };
+  
+  for(int j = 0; j < n; j++){
+    const depression<T>& d = dep[order[j]];
+    id[j] = j+1;
+    parent[j] = d.parent == 0 ? NA_INTEGER : id_of[d.parent];
+    pit_cell[j] = cell_number(d.pit_cell);
+    pit_elevation[j] = d.pit_cell == -1 ? NA_REAL : (double) d.pit;
+    spill_cell[j] = cell_number(d.spill_cell);
+    spill_elevation[j] = d.spill;
+    spill_to[j] = d.spill_to == 0 ? 0 : id_of[alias[d.spill_to]];
+    cells[j] = d.cells;
+    volume[j] = d.cells*d.spill - d.sum_z;
+    depth[j] = d.pit_cell == -1 ? NA_REAL : (double) d.spill - d.pit;
+  }
+  
+  DataFrame table = DataFrame::create(_["id"] = id, _["parent"] = parent, _["pit_cell"] = pit_cell, _["pit_elevation"] = pit_elevation, 
+                                      _["spill_cell"] = spill_cell, _["spill_elevation"] = spill_elevation, _["spill_to"] = spill_to, 
+                                      _["cells"] = cells, _["volume"] = volume, _["depth"] = depth);
+  
+  return List::create(_["dem"] = dem, _["labels"] = labels, _["depressions"] = table);
 }
 
-// Watershed delineation
+template <int RTYPE>
+static List pf_depressions_barnes2020_t(Matrix<RTYPE> dem, string queue, bool stats){
+  
+  kernel_stats st(stats);
+  queue = open_queue(dem.begin(), dem.size(), queue);
+  
+  if(queue == "bucket")
+    return with_stats(pf_depressions_barnes2020_q<RTYPE, bucket_queue>(dem, st), st, stats);
+  else if(queue == "dary")
+    return with_stats(pf_depressions_barnes2020_q<RTYPE, dary_queue>(dem, st), st, stats);
+  else
+    return with_stats(pf_depressions_barnes2020_q<RTYPE, heap_queue>(dem, st), st, stats);
+}
 
-//' Function for d8 watersheds to a target area identified by row-col indexes
-//' Potentially with labeling of nested watersheds
+//' Priority flood with a depression hierarchy, following:
+//' "Barnes, R., Callaghan, K.L., Wickert, A.D., 2020. Computing water flow through complex landscapes – Part 2: Finding hierarchies in depressions and morphological segmentations. Earth Surface Dynamics 8, 431–445. doi:10.5194/esurf-8-431-2020"
 //'
-//' @param flowdirs The d8 pointer flow direction raster
-//' @param target_rc The outlet
-//' @param nested Boolean
-//' @return a flow accumulation raster
+//' The DEM is filled as with pf_barnes2014 and each cell is labelled with the pit it drains to. Pits meeting at a pass below the spill 
+//' elevation of their surroundings are merged into new depressions, so depressions form a tree with the outermost depressions at the top.
+//'
+//' @param dem The input digital elevation model (DEM), an integer or double matrix
+//' @param queue The open set of the priority flood: 'heap' (binary heap, default), 'dary' (4-ary heap), 'bucket' (bucket queue, integer DEMs only) or 'auto'
+//' @param stats Attach statistics of the run (phase times, queue pushes and sizes, depressions as pit_cells and raised cells) as attribute 'stats'
+//' @return List with the filled DEM, an integer raster with the pit of each cell (0 for cells draining to the edges and nodata) and a data frame of 
+//' depressions: id (pits first), parent (the depression it merges into, NA if it spills to the edge), pit_cell and pit_elevation (lowest cell below the spill elevation), 
+//' spill_cell, spill_elevation, spill_to (the pit across the spill point, 0 for the edge), cells (number of cells below the spill elevation), 
+//' volume (in cells times elevation units) and depth. Cell numbers are row-major, starting at 1 as in terra
 // [[Rcpp::export]]
-IntegerMatrix d8_watershed_nested(IntegerMatrix flowdirs, NumericMatrix target_rc, bool nested){
+SEXP pf_depressions_barnes2020(SEXP dem, std::string queue = "heap", bool stats = false){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return pf_depressions_barnes2020_t<INTSXP>(dem, queue, stats);
+  case REALSXP:
+    return pf_depressions_barnes2020_t<REALSXP>(dem, queue, stats);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
 
-  IntegerMatrix watershed(flowdirs.nrow(), flowdirs.ncol());
-  std::queue<cellz> expansion;
-  int watershed_nodata = 0;
+// Parallel depression filling
+
+// Rectangular window of the DEM processed as one unit by the tiled algorithms.
+// Rows and columns inside a tile are local, i.e. relative to r0 and c0.
+class tile{
+public:
+  int r0;
+  int c0;
+  int nrow;
+  int ncol;
+  tile(){}
+  tile(int r0, int c0, int nrow, int ncol): r0(r0), c0(c0), nrow(nrow), ncol(ncol){}
   
-  for(int r = 0; r < target_rc.nrow(); r++){
-    expansion.push(cellz(target_rc(r, 0)-1, target_rc(r, 1)-1, target_rc(r, 2)));
+  int perimeter_size() const {
+    if(nrow == 1)
+      return ncol;
+    if(ncol == 1)
+      return nrow;
+    return 2*ncol + 2*(nrow-2);
   }
   
-  while(expansion.size()>0){
-    cellz c = expansion.front();
-    expansion.pop();
+  bool on_perimeter(int r, int c) const {
+    return r == 0 || c == 0 || r == nrow-1 || c == ncol-1;
+  }
+  
+  // Perimeter cells are numbered along the top row, the bottom row, the left column and the right column
+  int perimeter_id(int r, int c) const {
+    if(r == 0)
+      return c;
+    if(r == nrow-1)
+      return ncol + c;
+    if(c == 0)
+      return 2*ncol + r-1;
+    return 2*ncol + nrow-2 + r-1;
+  }
+  
+  cell perimeter_cell(int i) const {
+    if(i < ncol)
+      return cell(0, i);
+    if(i < 2*ncol)
+      return cell(nrow-1, i-ncol);
+    if(i < 2*ncol + nrow-2)
+      return cell(i-2*ncol+1, 0);
+    return cell(i-2*ncol-(nrow-2)+1, ncol-1);
+  }
+};
+
+// Regular partition of a nrow x ncol grid into tiles of (at most) tile_nrow x tile_ncol cells
+class tiling{
+public:
+  int nrow;
+  int ncol;
+  int tile_nrow;
+  int tile_ncol;
+  int ntile_r;
+  int ntile_c;
+  tiling(int nrow, int ncol, int tile_nrow, int tile_ncol): nrow(nrow), ncol(ncol), tile_nrow(tile_nrow), tile_ncol(tile_ncol){
+    ntile_r = (nrow + tile_nrow - 1) / tile_nrow;
+    ntile_c = (ncol + tile_ncol - 1) / tile_ncol;
+  }
+  
+  int size() const {
+    return ntile_r*ntile_c;
+  }
+  
+  tile get(int i) const {
+    int r0 = (i % ntile_r)*tile_nrow;
+    int c0 = (i / ntile_r)*tile_ncol;
+    return tile(r0, c0, min(tile_nrow, nrow-r0), min(tile_ncol, ncol-c0));
+  }
+  
+  int tile_of(int r, int c) const {
+    return r/tile_nrow + (c/tile_ncol)*ntile_r;
+  }
+};
+
+// Lowest elevation at which water can pass between the areas draining to two perimeter cells of a tile
+class spill_edge{
+public:
+  int a;
+  int b;
+  double z;
+  spill_edge(){}
+  spill_edge(int a, int b, double z): a(a), b(b), z(z){}
+};
+
+// Stage 1 of the parallel priority flood (Barnes 2016)
+// The tile is flooded inwards from its perimeter and each cell is labelled with the perimeter cell it is flooded from.
+// Where two labels meet, the lowest elevation at which water can spill between them is recorded.
+// The tile is accessed column-major with leading dimension ld and is not modified.
+template <typename T>
+static void pf_tile_spill(const T* dem, int ld, const tile& t, vector<double>& perimeter_z, vector<spill_edge>& edges){
+  
+  priority_queue<cellz<T>, vector<cellz<T>>, greater<cellz<T>>> open;
+  queue<cellz<T>> pit;
+  grid g(t.nrow, t.ncol);
+  grid m(ld, t.ncol); // The tile in the DEM, only used for index()
+  vector<T> level(g.size());
+  vector<int> labels(g.size());
+  vector<bool> closed(g.size());
+  
+  perimeter_z.resize(t.perimeter_size());
+  for(int i = 0; i < t.perimeter_size(); i++){
+    cell p = t.perimeter_cell(i);
+    size_t j = g.index(p.r, p.c);
+    T z = elevation(dem[m.index(p.r, p.c)]);
+    perimeter_z[i] = z;
+    level[j] = z;
+    labels[j] = i;
+    closed[j] = true;
+    open.push(cellz<T>(p.r, p.c, z));
+  }
+  
+  while(open.size()>0 || pit.size()>0){
+    cellz<T> c;
+    if(pit.size()>0){
+      c = pit.front();
+      pit.pop();
+    } else {
+      c=open.top();
+      open.pop();
+    }
     
-    for(int n = 1; n <= 8; n++){
+    int clabel = labels[g.index(c.r, c.c)];
+    
+    for(int n=1; n<=8; n++){
+      int nc=c.c+dx[n];
+      int nr=c.r+dy[n];
+      if(!g.inside(nr, nc))
+        continue;
       
-      int nc = c.c+dx[n];
-      int nr = c.r+dy[n];
-      double label = 1;
+      size_t ni = g.index(nr, nc);
+      if(closed[ni])
+        continue;
       
-      if(nested){
-        label = c.z;
-      }
+      closed[ni] = true;
+      labels[ni] = clabel;
+      
+      T z = elevation(dem[m.index(nr, nc)]);
       
-      if(!(0<=nc && nc<flowdirs.ncol() && 0<=nr && nr<flowdirs.nrow()))
+      if(z <= c.z){
+        level[ni] = c.z;
+        pit.push(cellz<T>(nr, nc, c.z));
+      } else {
+        level[ni] = z;
+        open.push(cellz<T>(nr, nc, z));
+      }
+    }
+  }
+  
+  // Neighbouring labels, each pair of cells is visited once using the facets 5 to 8
+  unordered_map<long long, double> spill;
+  long long nlabels = t.perimeter_size();
+  
+  for(int c = 0; c < t.ncol; c++){
+    for(int r = 0; r < t.nrow; r++){
+      size_t i = g.index(r, c);
+      for(int n=5; n<=8; n++){
+        if(!g.inside(r+dy[n], c+dx[n]))
+          continue;
+        
+        size_t ni = i + g.offset[n];
+        int a = labels[i];
+        int b = labels[ni];
+        if(a == b)
+          continue;
+        
+        double z = max(level[i], level[ni]);
+        long long key = min(a, b)*nlabels + max(a, b);
+        
+        auto it = spill.find(key);
+        if(it == spill.end())
+          spill.emplace(key, z);
+        else if(z < it->second)
+          it->second = z;
+      }
+    }
+  }
+  
+  edges.clear();
+  edges.reserve(spill.size());
+  for(auto& s : spill){
+    edges.push_back(spill_edge(s.first / nlabels, s.first % nlabels, s.second));
+  }
+}
+
+// Stage 2 of the parallel priority flood (Barnes 2016)
+// The perimeter cells of all tiles form a graph linked by the spill edges within tiles and by neighbouring cells across tiles.
+// Flooding the graph from the DEM edge gives the level each perimeter cell is filled to.
+// Levels are returned in tile order, each tile holding tile.perimeter_size() values.
+static vector<double> pf_spill_levels(const tiling& tl, const vector<vector<double>>& perimeter_z, const vector<vector<spill_edge>>& edges){
+  
+  vector<int> offset(tl.size()+1, 0);
+  for(int i = 0; i < tl.size(); i++){
+    offset[i+1] = offset[i] + tl.get(i).perimeter_size();
+  }
+  int nnodes = offset[tl.size()];
+  
+  // Edges as adjacency lists in compressed sparse row format
+  vector<spill_edge> links;
+  for(int i = 0; i < tl.size(); i++){
+    for(const spill_edge& e : edges[i]){
+      links.push_back(spill_edge(offset[i] + e.a, offset[i] + e.b, e.z));
+    }
+  }
+  
+  grid g(tl.nrow, tl.ncol);
+  
+  for(int i = 0; i < tl.size(); i++){
+    tile t = tl.get(i);
+    for(int p = 0; p < t.perimeter_size(); p++){
+      cell pc = t.perimeter_cell(p);
+      int r = t.r0 + pc.r;
+      int c = t.c0 + pc.c;
+      for(int n=5; n<=8; n++){
+        int nc=c+dx[n];
+        int nr=r+dy[n];
+        if(!g.inside(nr, nc))
+          continue;
+        
+        int j = tl.tile_of(nr, nc);
+        if(j == i)
+          continue;
+        
+        tile u = tl.get(j);
+        int q = u.perimeter_id(nr-u.r0, nc-u.c0);
+        links.push_back(spill_edge(offset[i] + p, offset[j] + q, max(perimeter_z[i][p], perimeter_z[j][q])));
+      }
+    }
+  }
+  
+  vector<int> start(nnodes+1, 0);
+  for(const spill_edge& e : links){
+    start[e.a+1]++;
+    start[e.b+1]++;
+  }
+  for(int i = 0; i < nnodes; i++){
+    start[i+1] += start[i];
+  }
+  vector<int> fill_pos(start.begin(), start.end()-1);
+  vector<int> to(2*links.size());
+  vector<double> weight(2*links.size());
+  for(const spill_edge& e : links){
+    to[fill_pos[e.a]] = e.b;
+    weight[fill_pos[e.a]++] = e.z;
+    to[fill_pos[e.b]] = e.a;
+    weight[fill_pos[e.b]++] = e.z;
+  }
+  
+  // Flood the graph from the perimeter cells on the DEM edge
+  vector<double> levels(nnodes, numeric_limits<double>::infinity());
+  vector<bool> closed(nnodes);
+  priority_queue<pair<double, int>, vector<pair<double, int>>, greater<pair<double, int>>> open;
+  
+  for(int i = 0; i < tl.size(); i++){
+    tile t = tl.get(i);
+    for(int p = 0; p < t.perimeter_size(); p++){
+      cell pc = t.perimeter_cell(p);
+      if(g.edge(t.r0 + pc.r, t.c0 + pc.c)){
+        levels[offset[i] + p] = perimeter_z[i][p];
+        open.push(make_pair(perimeter_z[i][p], offset[i] + p));
+      }
+    }
+  }
+  
+  while(open.size()>0){
+    int a = open.top().second;
+    open.pop();
+    
+    if(closed[a])
+      continue;
+    closed[a] = true;
+    
+    for(int k = start[a]; k < start[a+1]; k++){
+      double z = max(levels[a], weight[k]);
+      if(z < levels[to[k]]){
+        levels[to[k]] = z;
+        open.push(make_pair(z, to[k]));
+      }
+    }
+  }
+  
+  return levels;
+}
+
+// Stage 3 of the parallel priority flood (Barnes 2016)
+// The tile perimeter is raised to the levels from the spill graph and the tile is flooded inwards from there (as pf_barnes2014).
+template <typename T>
+static void pf_tile_fill(T* dem, int ld, const tile& t, const double* levels){
+  
+  priority_queue<cellz<T>, vector<cellz<T>>, greater<cellz<T>>> open;
+  queue<cellz<T>> pit;
+  grid g(t.nrow, t.ncol);
+  grid m(ld, t.ncol); // The tile in the DEM, only used for index()
+  vector<bool> closed(g.size());
+  
+  for(int i = 0; i < t.perimeter_size(); i++){
+    cell p = t.perimeter_cell(i);
+    T& z = dem[m.index(p.r, p.c)];
+    if(!is_nodata(z))
+      z = levels[i];
+    closed[g.index(p.r, p.c)] = true;
+    open.push(cellz<T>(p.r, p.c, (T) levels[i]));
+  }
+  
+  while(open.size()>0 || pit.size()>0){
+    cellz<T> c;
+    if(pit.size()>0){
+      c = pit.front();
+      pit.pop();
+    } else {
+      c=open.top();
+      open.pop();
+    }
+    
+    for(int n=1; n<=8; n++){
+      int nc=c.c+dx[n];
+      int nr=c.r+dy[n];
+      if(!g.inside(nr, nc))
         continue;
       
-      else if(flowdirs(nr, nc) == flowdir_nodata)
+      size_t ni = g.index(nr, nc);
+      if(closed[ni])
         continue;
       
-      else if(watershed(nr, nc) == watershed_nodata && n == d8_inv[flowdirs(nr, nc)]){
-        expansion.push(cellz(nr, nc, label));
-        watershed(nr, nc) = label;
+      closed[ni] = true;
+      
+      T& z = dem[m.index(nr, nc)];
+      
+      if(elevation(z) <= c.z){
+        if(!is_nodata(z))
+          z = c.z;
+        pit.push(cellz<T>(nr, nc, c.z));
+      } else {
+        open.push(cellz<T>(nr, nc, z));
       }
     }
   }
+}
+
+// Workers running stage 1 and stage 3 on a range of tiles
+template <int RTYPE>
+struct pf_spill_worker : public RcppParallel::Worker {
+  
+  RcppParallel::RMatrix<typename traits::storage_type<RTYPE>::type> dem;
+  const tiling& tl;
+  vector<vector<double>>& perimeter_z;
+  vector<vector<spill_edge>>& edges;
+  
+  pf_spill_worker(Matrix<RTYPE> dem, const tiling& tl, vector<vector<double>>& perimeter_z, vector<vector<spill_edge>>& edges): 
+    dem(dem), tl(tl), perimeter_z(perimeter_z), edges(edges){}
+  
+  void operator()(size_t begin, size_t end){
+    for(size_t i = begin; i < end; i++){
+      tile t = tl.get(i);
+      pf_tile_spill(dem.begin() + (size_t) t.c0*dem.nrow() + t.r0, dem.nrow(), t, perimeter_z[i], edges[i]);
+    }
+  }
+};
+
+template <int RTYPE>
+struct pf_fill_worker : public RcppParallel::Worker {
   
-  return watershed;
+  RcppParallel::RMatrix<typename traits::storage_type<RTYPE>::type> dem;
+  const tiling& tl;
+  const vector<double>& levels;
+  const vector<int>& offset;
+  
+  pf_fill_worker(Matrix<RTYPE> dem, const tiling& tl, const vector<double>& levels, const vector<int>& offset): 
+    dem(dem), tl(tl), levels(levels), offset(offset){}
+  
+  void operator()(size_t begin, size_t end){
+    for(size_t i = begin; i < end; i++){
+      tile t = tl.get(i);
+      pf_tile_fill(dem.begin() + (size_t) t.c0*dem.nrow() + t.r0, dem.nrow(), t, &levels[offset[i]]);
+    }
+  }
+};
+
+template <int RTYPE>
+static Matrix<RTYPE> pf_parallel_barnes2016_t(Matrix<RTYPE> dem, int tile_size, int threads){
+  
+  if(tile_size < 1)
+    stop("tile_size must be positive");
+  
+  tiling tl(dem.nrow(), dem.ncol(), tile_size, tile_size);
+  
+  vector<vector<double>> perimeter_z(tl.size());
+  vector<vector<spill_edge>> edges(tl.size());
+  
+  pf_spill_worker<RTYPE> spill_worker(dem, tl, perimeter_z, edges);
+  RcppParallel::parallelFor(0, tl.size(), spill_worker, 1, threads);
+  
+  vector<double> levels = pf_spill_levels(tl, perimeter_z, edges);
+  
+  vector<int> offset(tl.size(), 0);
+  for(int i = 1; i < tl.size(); i++){
+    offset[i] = offset[i-1] + tl.get(i-1).perimeter_size();
+  }
+  
+  pf_fill_worker<RTYPE> fill_worker(dem, tl, levels, offset);
+  RcppParallel::parallelFor(0, tl.size(), fill_worker, 1, threads);
+  
+  return(dem);
+}
+
+//' Parallel priority flood in:
+//' "Barnes, R., 2016. Parallel priority-flood depression filling for trillion cell digital elevation models on desktops or clusters. Computers & Geosciences 96, 56–68. doi:10.1016/j.cageo.2016.07.001"
+//'
+//' The DEM is split into tiles which are flooded independently, the tile-edge spill graph is solved and the tiles are filled.
+//' The result is identical to pf_barnes2014.
+//'
+//' @param dem The input digital elevation model (DEM), an integer or double matrix
+//' @param tile_size The number of rows and columns in each tile
+//' @param threads The number of threads
+//' @return The DEM with depressions removed
+// [[Rcpp::export]]
+SEXP pf_parallel_barnes2016(SEXP dem, int tile_size, int threads){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return pf_parallel_barnes2016_t<INTSXP>(dem, tile_size, threads);
+  case REALSXP:
+    return pf_parallel_barnes2016_t<REALSXP>(dem, tile_size, threads);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
+
+template <int RTYPE>
+static List pf_tile_spill_barnes2016_t(Matrix<RTYPE> dem){
+  
+  tile t(0, 0, dem.nrow(), dem.ncol());
+  vector<double> perimeter_z;
+  vector<spill_edge> edges;
+  
+  pf_tile_spill(dem.begin(), dem.nrow(), t, perimeter_z, edges);
+  
+  IntegerVector a(edges.size());
+  IntegerVector b(edges.size());
+  NumericVector z(edges.size());
+  for(size_t i = 0; i < edges.size(); i++){
+    a[i] = edges[i].a;
+    b[i] = edges[i].b;
+    z[i] = edges[i].z;
+  }
+  
+  List result = List::create(_["perimeter"] = wrap(perimeter_z), _["a"] = a, _["b"] = b, _["z"] = z);
+  
+  return(result);
+}
+
+//' Stage 1 of the tiled priority flood (Barnes 2016) for a single tile, used when processing DEMs tile by tile from disk
+//'
+//' @param dem One tile of the digital elevation model (DEM), an integer or double matrix
+//' @return List with the elevations of the tile perimeter cells (perimeter) and the spill edges between them (a, b, z)
+// [[Rcpp::export]]
+SEXP pf_tile_spill_barnes2016(SEXP dem){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return pf_tile_spill_barnes2016_t<INTSXP>(dem);
+  case REALSXP:
+    return pf_tile_spill_barnes2016_t<REALSXP>(dem);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
+
+//' Stage 2 of the tiled priority flood (Barnes 2016), solving the spill graph of all tiles
+//'
+//' @param tiles List with the result of pf_tile_spill_barnes2016 for each tile, tiles ordered column-major
+//' @param nrow Number of rows in the DEM
+//' @param ncol Number of columns in the DEM
+//' @param tile_nrow Number of rows in each tile
+//' @param tile_ncol Number of columns in each tile
+//' @return List with the fill levels of the perimeter cells of each tile
+// [[Rcpp::export]]
+List pf_spill_levels_barnes2016(List tiles, int nrow, int ncol, int tile_nrow, int tile_ncol){
+  
+  tiling tl(nrow, ncol, tile_nrow, tile_ncol);
+  
+  if(tiles.size() != tl.size())
+    stop("Number of tiles does not match the tiling of the DEM");
+  
+  vector<vector<double>> perimeter_z(tl.size());
+  vector<vector<spill_edge>> edges(tl.size());
+  
+  for(int i = 0; i < tl.size(); i++){
+    List tile_spill = tiles[i];
+    NumericVector perimeter = tile_spill["perimeter"];
+    IntegerVector a = tile_spill["a"];
+    IntegerVector b = tile_spill["b"];
+    NumericVector z = tile_spill["z"];
+    
+    if(perimeter.size() != tl.get(i).perimeter_size())
+      stop("Perimeter of tile does not match the tiling of the DEM");
+    
+    perimeter_z[i].assign(perimeter.begin(), perimeter.end());
+    for(int k = 0; k < a.size(); k++){
+      edges[i].push_back(spill_edge(a[k], b[k], z[k]));
+    }
+  }
+  
+  vector<double> levels = pf_spill_levels(tl, perimeter_z, edges);
+  
+  List result(tl.size());
+  size_t offset = 0;
+  for(int i = 0; i < tl.size(); i++){
+    size_t size = tl.get(i).perimeter_size();
+    result[i] = NumericVector(levels.begin() + offset, levels.begin() + offset + size);
+    offset += size;
+  }
+  
+  return(result);
+}
+
+template <int RTYPE>
+static Matrix<RTYPE> pf_tile_fill_barnes2016_t(Matrix<RTYPE> dem, NumericVector levels){
+  
+  tile t(0, 0, dem.nrow(), dem.ncol());
+  
+  if(levels.size() != t.perimeter_size())
+    stop("Number of levels does not match the perimeter of the tile");
+  
+  pf_tile_fill(dem.begin(), dem.nrow(), t, levels.begin());
+  
+  return(dem);
+}
+
+//' Stage 3 of the tiled priority flood (Barnes 2016) for a single tile
+//'
+//' @param dem One tile of the digital elevation model (DEM), an integer or double matrix
+//' @param levels Fill levels of the tile perimeter cells from pf_spill_levels_barnes2016
+//' @return The tile with depressions removed
+// [[Rcpp::export]]
+SEXP pf_tile_fill_barnes2016(SEXP dem, NumericVector levels){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return pf_tile_fill_barnes2016_t<INTSXP>(dem, levels);
+  case REALSXP:
+    return pf_tile_fill_barnes2016_t<REALSXP>(dem, levels);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
+
+// Lowest neighbour of an interior cell of a grid, the cell is a strict pit when it is lower than this
+template <typename T>
+static T lowest_neighbour(const T* z, const grid& g, size_t i){
+  T lowest = numeric_limits<T>::max();
+  for(int n = 1; n <= 8; n++)
+    lowest = min(elevation(z[i + g.offset[n]]), lowest);
+  return lowest;
+}
+
+// Limits of constrained breaching, pits which can not be breached within the limits are filled instead
+struct breach_limits {
+  double max_depth = numeric_limits<double>::infinity();  // Largest lowering of a cell on a breach path
+  double max_length = numeric_limits<double>::infinity(); // Most cells on a breach path, not counting the pit
+  bool fill = true;                                       // Fill the pits which are not breached
+  
+  bool constrained() const { return max_depth < numeric_limits<double>::infinity() || max_length < numeric_limits<double>::infinity(); }
+};
+
+// Breaches single-cell pits by lowering the cell between the pit and its lowest cell two cells away, when that cell is 
+// lower than the pit, to halfway between the two. Pits next to edges or nodata are left to the priority flood.
+// The depth limit is checked against original, the elevations before breaching.
+template <typename T, class O>
+static void breach_single_cell_pits(T* z, O& original, const grid& g, const breach_limits& limits, kernel_stats& st){
+  
+  if(limits.max_length < 1)
+    return;
+  
+  for(int c = 1; c < g.ncol-1; c++){
+    for(int r = 1; r < g.nrow-1; r++){
+      
+      size_t i = g.index(r, c);
+      
+      if(is_nodata(z[i]) || lowest_neighbour(z, g, i) <= z[i])
+        continue;
+      
+      // Lowest cell two cells away
+      int tr = -1, tc = -1;
+      for(int dr = -2; dr <= 2; dr++){
+        for(int dc = -2; dc <= 2; dc++){
+          if(std::abs(dr) != 2 && std::abs(dc) != 2)
+            continue;
+          if(!g.inside(r+dr, c+dc) || is_nodata(z[g.index(r+dr, c+dc)]))
+            continue;
+          if(z[g.index(r+dr, c+dc)] < (tr == -1 ? z[i] : z[g.index(tr, tc)])){
+            tr = r+dr;
+            tc = c+dc;
+          }
+        }
+      }
+      
+      if(tr == -1)
+        continue;
+      
+      // The lower of the cells next to both the pit and the target
+      size_t mid = g.index(r + (tr-r)/2, c + (tc-c)/2);
+      if(std::abs(tr-r) == 1 && z[g.index(tr, c + (tc-c)/2)] < z[mid])
+        mid = g.index(tr, c + (tc-c)/2);
+      if(std::abs(tc-c) == 1 && z[g.index(r + (tr-r)/2, tc)] < z[mid])
+        mid = g.index(r + (tr-r)/2, tc);
+      
+      T target = z[g.index(tr, tc)];
+      T lowered = target + (z[i] - target)/2;
+      if(lowered >= z[mid] || (double) original[mid] - lowered > limits.max_depth)
+        continue;
+      
+      z[mid] = lowered;
+      st.lowered_cells++;
+    }
+  }
+}
+
+template <typename T, template <typename> class Q, class S>
+static void comp_breach_lindsay2016_q(matrix_view<T> dem, kernel_stats& st, const string& scratch_dir, const breach_limits& limits){
+
+  const int NO_BACK_LINK = numeric_limits<int>::max();
+  
+  const unsigned char UNVISITED = 0;
+  const unsigned char VISITED = 1;
+  const unsigned char EDGE = 2;
+  
+  grid g(dem.nrow(), dem.ncol());
+  T* z = dem.begin();
+  
+  typename S::template values<int> backlinks(g, NO_BACK_LINK, scratch_dir);
+  typename S::template values<unsigned char> visited(g, UNVISITED, scratch_dir);
+  typename S::bits pits(g, scratch_dir);
+  
+  int total_pits = 0;
+  int unbreached_pits = 0;
+  Q<T> pq(dem.begin(), dem.nrow(), dem.ncol()); // Slightly different queue used in RichDEM
+  
+  // With a depth limit the elevations before breaching are kept, as a cell can be lowered by more than one breach. 
+  // The grid is only allocated when needed.
+  bool limited_depth = limits.max_depth < numeric_limits<double>::infinity();
+  std::optional<typename S::template values<T>> original;
+  if(limited_depth){
+    original.emplace(g, T(), scratch_dir);
+    for(size_t i = 0; i < g.size(); i++)
+      (*original)[i] = z[i];
+  }
+  
+  st.setup_seconds = st.lap();
+  
+  if(limits.constrained() && limited_depth)
+    breach_single_cell_pits(z, *original, g, limits, st);
+  else if(limits.constrained())
+    breach_single_cell_pits(z, z, g, limits, st);
+  
+  // Seed the priority queue, sweeping the DEM in storage order
+  // RichDEM sweeps row by row and raises each pit as it is found, so cells later in the sweep see the raised pits. 
+  // Only cells lower than all their neighbours are raised and they are raised to their lowest neighbour, so this is 
+  // repeated by counting a neighbour before the cell in row-major order as raised when it is lower than all its 
+  // neighbours. The raising is done after the sweep and edge cells are pushed in row-major order, which gives the 
+  // same queue order and result as the row by row sweep.
+  vector<int> edges;
+  vector<pair<size_t, T>> raised;
+  
+  for(int c = 0; c < g.ncol; c++){
+    for(int r = 0; r < g.nrow; r++){
+      
+      size_t i = g.index(r, c);
+      
+      if(is_nodata(z[i]))
+        continue;
+      
+      bool edge = g.edge(r, c);
+      T lowest = numeric_limits<T>::max();
+      for(int n = 1; n <= 8 && !edge; n++){
+        edge = is_nodata(z[i + g.offset[n]]);
+        lowest = min(z[i + g.offset[n]], lowest);
+      }
+      
+      if(edge){
+        edges.push_back(i);
+        visited[i] = EDGE;
+        continue;
+      }
+      
+      bool pit = z[i] <= lowest;
+      
+      // A lower neighbour counts as raised to the elevation of the cell when it comes before the cell in row-major 
+      // order and the cell is its lowest neighbour
+      if(!pit){
+        pit = true;
+        for(int n = 1; n <= 8 && pit; n++){
+          size_t j = i + g.offset[n];
+          if(z[j] < z[i]){
+            bool before = dy[n] < 0 || (dy[n] == 0 && dx[n] < 0);
+            pit = before && !g.edge(r+dy[n], c+dx[n]) && lowest_neighbour(z, g, j) == z[i];
+          }
+        }
+      }
+      
+      if(pit){
+        if(z[i] < lowest)
+          raised.push_back(make_pair(i, lowest));
+        pits.set(i);
+        total_pits++;
+      }
+    }
+  }
+  
+  for(size_t k = 0; k < raised.size(); k++){
+    st.raised_cells++;
+    z[raised[k].first] = raised[k].second;
+  }
+  
+  sort(edges.begin(), edges.end(), [&g](int a, int b){
+    return g.row(a) < g.row(b) || (g.row(a) == g.row(b) && a < b);
+  });
+  
+  for(size_t k = 0; k < edges.size(); k++){
+    pq.push(cellz<T>(g.row(edges[k]), g.col(edges[k]), z[edges[k]]));
+    st.pushes++;
+  }
+  
+  st.pit_cells = total_pits;
+  st.seed_seconds = st.lap();
+  
+  while(!pq.empty()){
+    
+    st.queues(pq.size(), 0);
+    const cellz<T> c = pq.top();
+    pq.pop();
+    
+    size_t i = g.index(c.r, c.c);
+    
+    if(pits[i]){
+      
+      chrono::steady_clock::time_point trace_start;
+      if(st.enabled)
+        trace_start = chrono::steady_clock::now();
+      size_t trace_length = 0;
+      
+      //Locate a cell that is lower than the pit cell, or an edge cell
+      int cc = i;
+      T target_height = z[i];
+      
+      //With limits, the path is followed first without lowering it, and only as far as the limits allow
+      bool breach = true;
+      if(limits.constrained()){
+        double depth = 0;
+        for(double length = 0; cc != NO_BACK_LINK && z[cc] >= target_height; length++){
+          depth = max(depth, (double) (limited_depth ? (*original)[cc] : z[cc]) - target_height);
+          if(depth > limits.max_depth || length > limits.max_length){
+            breach = false;
+            break;
+          }
+          cc = backlinks[cc];
+        }
+        cc = i;
+      }
+      
+      //Trace path back to a cell low enough for the path to drain into it, or
+      //to an edge of the DEM
+      while(breach && cc != NO_BACK_LINK && z[cc] >= target_height){
+        st.lowered_cells += z[cc] > target_height;
+        trace_length++;
+        z[cc] = target_height;
+        cc = backlinks[cc];
+      }
+      
+      if(breach)
+        st.trace(trace_length, st.enabled ? chrono::duration<double>(chrono::steady_clock::now() - trace_start).count() : 0);
+      else
+        unbreached_pits++;
+      
+      --total_pits;
+      
+      if(total_pits==0)
+        break;
+    }
+    
+    //Looks for neighbours which are either unvisited or pits
+    for(int n = 1; n <= 8; n++){
+      const int nc = c.c+dx[n];
+      const int nr = c.r+dy[n];
+      
+      if(!g.inside(nr, nc))
+        continue;
+      
+      size_t ni = i + g.offset[n];
+      
+      if(is_nodata(z[ni]))
+        continue;
+      
+      if(visited[ni] != UNVISITED)
+        continue;
+      
+      T my_e = z[ni];
+      
+      pq.push(cellz<T>(nr, nc, my_e));
+      st.pushes++;
+      visited[ni] = VISITED;
+      backlinks[ni] = i;
+    }
+  }
+  
+  st.flood_seconds = st.lap();
+  st.unbreached_pits = unbreached_pits;
+  
+  // The depressions of the pits which were not breached are filled
+  if(unbreached_pits > 0 && limits.fill){
+    kernel_stats fill_st(false);
+    pf_barnes2014_q<T, Q>(dem, fill_st);
+    st.raised_cells += fill_st.raised_cells;
+    st.flood_seconds += st.lap();
+  }
+}
+
+// Runs comp_breach_lindsay2016_q with the queue named by queue and scratch grids of kind S
+template <typename T, class S>
+static void comp_breach_lindsay2016_s(matrix_view<T> dem, const string& queue, kernel_stats& st, const string& scratch_dir, const breach_limits& limits){
+  
+  if(queue == "bucket")
+    comp_breach_lindsay2016_q<T, bucket_queue, S>(dem, st, scratch_dir, limits);
+  else if(queue == "dary")
+    comp_breach_lindsay2016_q<T, dary_queue, S>(dem, st, scratch_dir, limits);
+  else
+    comp_breach_lindsay2016_q<T, heap_queue, S>(dem, st, scratch_dir, limits);
+}
+
+template <int RTYPE>
+static Matrix<RTYPE> comp_breach_lindsay2016_t(Matrix<RTYPE> dem, string queue, bool stats, string scratch_dir, const breach_limits& limits){
+  
+  typedef typename traits::storage_type<RTYPE>::type T;
+  dem = stats_result(dem, stats);
+  kernel_stats st(stats);
+  queue = open_queue(dem.begin(), dem.size(), queue);
+  
+  if(scratch_dir.empty())
+    comp_breach_lindsay2016_s<T, memory_scratch>(matrix_view<T>(dem), queue, st, scratch_dir, limits);
+  else
+    comp_breach_lindsay2016_s<T, mapped_scratch>(matrix_view<T>(dem), queue, st, scratch_dir, limits);
+  
+  return with_stats(dem, st, stats);
+}
+
+//' Complete breaching algorithm:
+//' "Lindsay, J.B., 2016. Efficient hybrid breaching-filling sink removal methods for flow path enforcement in digital elevation models: Efficient Hybrid Sink Removal Methods for Flow Path Enforcement. Hydrological Processes 30, 846--857. doi:10.1002/hyp.10648"
+//' As implemented in RichDEM
+//'
+//' With max_depth or max_length, single-cell pits are first breached by lowering one cell, and pits without a breach path 
+//' within the limits are left unbreached and filled afterwards (constrained breaching).
+//'
+//' @param dem The input digital elevation model (DEM), an integer or double matrix
+//' @param queue The open set of the priority flood: 'heap' (binary heap, default), 'dary' (4-ary heap), 'bucket' (bucket queue, integer DEMs only) or 'auto'
+//' @param stats Attach statistics of the run (phase times, queue pushes and sizes, pits, unbreached pits, raised and lowered cells, breach path lengths) as attribute 'stats' of the result, which is then a copy of dem
+//' @param scratch_dir Directory for memory-mapped scratch grids, or "" (default) to keep them in memory
+//' @param max_depth Largest lowering of a cell on a breach path (default is no limit)
+//' @param max_length Most cells on a breach path, not counting the pit (default is no limit)
+//' @param fill Fill the depressions of pits which can not be breached within max_depth and max_length (default is TRUE)
+//' @return The DEM with depressions breached
+// [[Rcpp::export]]
+SEXP comp_breach_lindsay2016(SEXP dem, std::string queue = "heap", bool stats = false, std::string scratch_dir = "", 
+                             double max_depth = R_PosInf, double max_length = R_PosInf, bool fill = true){
+  
+  breach_limits limits;
+  limits.max_depth = max_depth;
+  limits.max_length = max_length;
+  limits.fill = fill;
+  
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return comp_breach_lindsay2016_t<INTSXP>(dem, queue, stats, scratch_dir, limits);
+  case REALSXP:
+    return comp_breach_lindsay2016_t<REALSXP>(dem, queue, stats, scratch_dir, limits);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
+
+// Flow directions
+
+// Helper function for determining d8 flow directions of one column of the DEM (RichDEM)
+// Edge cells are handled separately, so the interior rows are processed without bounds checks. Each neighbour is 
+// compared for the whole column at a time using selects instead of branches, which allows the compiler to vectorize the loops.
+// The flow direction is the lowest neighbour, and among equally low neighbours the first cardinal one is preferred over diagonal ones.
+// Flow directions are written as int or as bytes (F).
+template <typename T, typename F>
+static void d8_flowdir_column(const T* dem, const grid& g, const int c, F* flowdirs, T* minimum_elevation){
+  
+  if(c == 0 || c == g.ncol-1 || g.nrow <= 2){
+    for(int r = 0; r < g.nrow; r++)
+      flowdirs[r] = d8_edge_flowdir(r, c, g.nrow, g.ncol);
+  } else {
+    const int m = g.nrow-2;
+    const T* z = dem + g.index(1, c);
+    F* fd = flowdirs + 1;
+    
+    for(int r = 0; r < m; r++){
+      minimum_elevation[r] = z[r];
+      fd[r] = 0;
+    }
+    
+    for(int n = 1; n <= 8; n++){
+      const T* zn = z + g.offset[n];
+      if(n%2 == 1){
+        for(int r = 0; r < m; r++){
+          T e = elevation(zn[r]);
+          bool lower = e < minimum_elevation[r] || (e == minimum_elevation[r] && fd[r] > 0 && fd[r]%2 == 0);
+          minimum_elevation[r] = lower ? e : minimum_elevation[r];
+          fd[r] = lower ? n : fd[r];
+        }
+      } else {
+        for(int r = 0; r < m; r++){
+          T e = elevation(zn[r]);
+          bool lower = e < minimum_elevation[r];
+          minimum_elevation[r] = lower ? e : minimum_elevation[r];
+          fd[r] = lower ? n : fd[r];
+        }
+      }
+    }
+    
+    flowdirs[0] = d8_edge_flowdir(0, c, g.nrow, g.ncol);
+    flowdirs[g.nrow-1] = d8_edge_flowdir(g.nrow-1, c, g.nrow, g.ncol);
+  }
+  
+  const T* z = dem + g.index(0, c);
+  for(int r = 0; r < g.nrow; r++)
+    flowdirs[r] = is_nodata(z[r]) ? flowdir_nodata : flowdirs[r];
+}
+
+// Worker determining flow directions for a range of columns
+template <int RTYPE, int FTYPE>
+struct d8_flowdir_worker : public RcppParallel::Worker {
+  
+  typedef typename traits::storage_type<RTYPE>::type T;
+  typedef typename traits::storage_type<FTYPE>::type F;
+  
+  RcppParallel::RMatrix<T> dem;
+  RcppParallel::RMatrix<F> flowdirs;
+  
+  d8_flowdir_worker(Matrix<RTYPE> dem, Matrix<FTYPE> flowdirs): dem(dem), flowdirs(flowdirs){}
+  
+  void operator()(size_t begin, size_t end){
+    grid g(dem.nrow(), dem.ncol());
+    vector<T> minimum_elevation(g.nrow);
+    for(size_t c = begin; c < end; c++){
+      d8_flowdir_column(dem.begin(), g, (int) c, flowdirs.begin() + g.index(0, c), minimum_elevation.data());
+    }
+  }
+};
+
+// Flat resolution in:
+// "Barnes, R., Lehman, C., Mulla, D., 2014. An efficient assignment of drainage direction over flat surfaces in raster digital elevation models. Computers & Geosciences 62, 128–135. doi:10.1016/j.cageo.2013.01.009"
+// Flat cells have no lower neighbour (flow direction 0) and are not nodata. Each flat is labelled from its low edges, 
+// cells with a flow direction next to a flat cell of the same elevation. The flat mask is a gradient towards the low 
+// edges combined with a gradient away from the higher terrain around the flat, and flat cells are directed to their 
+// lowest neighbour in the mask within the same flat. Flats without low edges (undrained depressions) keep direction 0.
+// All steps are breadth-first searches, so the time is linear in the number of cells.
+template <typename T, typename F>
+static void d8_resolve_flats(const T* dem, const grid& g, F* flowdirs){
+  
+  queue<size_t> low_edges;
+  queue<size_t> high_edges;
+  
+  for(int c = 0; c < g.ncol; c++){
+    for(int r = 0; r < g.nrow; r++){
+      size_t i = g.index(r, c);
+      
+      if(is_nodata(dem[i]))
+        continue;
+      
+      bool flat = flowdirs[i] == flowdir_nodata;
+      
+      for(int n = 1; n <= 8; n++){
+        if(!g.inside(r+dy[n], c+dx[n]))
+          continue;
+        
+        size_t j = i + g.offset[n];
+        
+        if(is_nodata(dem[j]))
+          continue;
+        
+        if(!flat && flowdirs[j] == flowdir_nodata && dem[j] == dem[i]){
+          low_edges.push(i);
+          break;
+        } else if(flat && dem[i] < dem[j]){
+          high_edges.push(i);
+          break;
+        }
+      }
+    }
+  }
+  
+  if(low_edges.empty())
+    return;
+  
+  // Label the cells of each flat, flooding cells of the same elevation from its low edges
+  vector<int> labels(g.size(), 0);
+  int nlabels = 0;
+  
+  queue<size_t> edges = low_edges;
+  while(!edges.empty()){
+    size_t i0 = edges.front();
+    edges.pop();
+    
+    if(labels[i0] > 0)
+      continue;
+    
+    nlabels++;
+    queue<size_t> flat_cells;
+    flat_cells.push(i0);
+    
+    while(!flat_cells.empty()){
+      size_t i = flat_cells.front();
+      flat_cells.pop();
+      
+      if(dem[i] != dem[i0] || labels[i] > 0)
+        continue;
+      
+      labels[i] = nlabels;
+      
+      for(int n = 1; n <= 8; n++){
+        if(g.inside(g.row(i)+dy[n], g.col(i)+dx[n]))
+          flat_cells.push(i + g.offset[n]);
+      }
+    }
+  }
+  
+  // Gradient away from higher terrain, stored negative to mark cells as visited by the second gradient
+  vector<int> flat_mask(g.size(), 0);
+  vector<int> flat_height(nlabels+1, 0);
+  
+  const size_t marker = numeric_limits<size_t>::max();
+  int loops = 1;
+  
+  high_edges.push(marker);
+  while(high_edges.size() > 1){
+    size_t i = high_edges.front();
+    high_edges.pop();
+    
+    if(i == marker){
+      loops++;
+      high_edges.push(marker);
+      continue;
+    }
+    
+    if(labels[i] == 0 || flat_mask[i] < 0)
+      continue;
+    
+    flat_mask[i] = -loops;
+    flat_height[labels[i]] = loops;
+    
+    for(int n = 1; n <= 8; n++){
+      if(!g.inside(g.row(i)+dy[n], g.col(i)+dx[n]))
+        continue;
+      size_t j = i + g.offset[n];
+      if(labels[j] == labels[i] && flowdirs[j] == flowdir_nodata && !is_nodata(dem[j]))
+        high_edges.push(j);
+    }
+  }
+  
+  // Gradient towards the low edges, combined with the gradient away from higher terrain
+  loops = 1;
+  
+  low_edges.push(marker);
+  while(low_edges.size() > 1){
+    size_t i = low_edges.front();
+    low_edges.pop();
+    
+    if(i == marker){
+      loops++;
+      low_edges.push(marker);
+      continue;
+    }
+    
+    if(flat_mask[i] > 0)
+      continue;
+    
+    if(flat_mask[i] < 0)
+      flat_mask[i] = flat_height[labels[i]] + flat_mask[i] + 2*loops;
+    else
+      flat_mask[i] = 2*loops;
+    
+    for(int n = 1; n <= 8; n++){
+      if(!g.inside(g.row(i)+dy[n], g.col(i)+dx[n]))
+        continue;
+      size_t j = i + g.offset[n];
+      if(labels[j] == labels[i] && flowdirs[j] == flowdir_nodata && !is_nodata(dem[j]))
+        low_edges.push(j);
+    }
+  }
+  
+  // Flow directions of flat cells on the mask, with the same preference for cardinal neighbours as d8_flowdir_column
+  for(int c = 0; c < g.ncol; c++){
+    for(int r = 0; r < g.nrow; r++){
+      size_t i = g.index(r, c);
+      
+      if(labels[i] == 0 || flowdirs[i] != flowdir_nodata || is_nodata(dem[i]))
+        continue;
+      
+      int minimum_mask = flat_mask[i];
+      int fd = flowdir_nodata;
+      
+      for(int n = 1; n <= 8; n++){
+        if(!g.inside(r+dy[n], c+dx[n]))
+          continue;
+        size_t j = i + g.offset[n];
+        if(labels[j] != labels[i])
+          continue;
+        if(flat_mask[j] < minimum_mask || (flat_mask[j] == minimum_mask && fd > 0 && fd%2 == 0 && n%2 == 1)){
+          minimum_mask = flat_mask[j];
+          fd = n;
+        }
+      }
+      
+      flowdirs[i] = fd;
+    }
+  }
+}
+
+template <int RTYPE, int FTYPE>
+static Matrix<FTYPE> d8_flow_directions_t(Matrix<RTYPE> dem, int threads, bool flats){
+  
+  if(threads < 1)
+    stop("threads must be positive");
+  
+  Matrix<FTYPE> flowdirs(dem.nrow(), dem.ncol());
+  
+  d8_flowdir_worker<RTYPE, FTYPE> worker(dem, flowdirs);
+  RcppParallel::parallelFor(0, dem.ncol(), worker, 64, threads);
+  
+  if(flats)
+    d8_resolve_flats(dem.begin(), grid(dem.nrow(), dem.ncol()), flowdirs.begin());
+  
+  return flowdirs;
+}
+
+//' Function for determining d8 flow directions (RichDEM)
+//'
+//' Columns of the DEM are processed in parallel.
+//' Cells without a lower neighbour get flow direction 0, unless flats are resolved as in:
+//' "Barnes, R., Lehman, C., Mulla, D., 2014. An efficient assignment of drainage direction over flat surfaces in raster digital elevation models. Computers & Geosciences 62, 128–135. doi:10.1016/j.cageo.2013.01.009"
+//' Resolving flats after pf_barnes2014 gives drainage over filled areas without the epsilon gradient of pf_eps_barnes2014, so integer DEMs can be used.
+//'
+//' @param dem The input digital elevation model (DEM), an integer or double matrix
+//' @param threads The number of threads
+//' @param raw Return the flow directions as a raw matrix (one byte per cell) instead of an integer matrix
+//' @param flats Direct flat cells towards the outlets of their flat (Barnes 2014 flat resolution)
+//' @return a d8 flow direction raster
+// [[Rcpp::export]]
+SEXP d8_flow_directions(SEXP dem, int threads = 1, bool raw = false, bool flats = false){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    if(raw)
+      return d8_flow_directions_t<INTSXP, RAWSXP>(dem, threads, flats);
+    return d8_flow_directions_t<INTSXP, INTSXP>(dem, threads, flats);
+  case REALSXP:
+    if(raw)
+      return d8_flow_directions_t<REALSXP, RAWSXP>(dem, threads, flats);
+    return d8_flow_directions_t<REALSXP, INTSXP>(dem, threads, flats);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
+
+// Number of upstream cells of each cell of a d8 flow direction raster, at most 8
+template <typename F>
+static void d8_dependencies(const F* flowdirs, const grid& g, vector<unsigned char>& dependency){
+  
+  dependency.assign(g.size(), 0);
+  
+  for(int c = 0; c<g.ncol; c++){
+    for(int r = 0; r<g.nrow; r++){
+      size_t i = g.index(r, c);
+      int n = flowdirs[i];
+      
+      if(n == flowdir_nodata || !g.inside(r+dy[n], c+dx[n]))
+        continue;
+      
+      ++dependency[i + g.offset[n]];
+    }
+  }
+}
+
+// Flow accumulation of a d8 flow direction raster into area, dependency is scratch space which can be reused between calls
+template <typename F>
+static void d8_flow_accum_q(const F* flowdirs, const grid& g, double* area, vector<unsigned char>& dependency){
+  
+  std::queue<size_t> sources;
+  double area_nodata = -1;
+  
+  d8_dependencies(flowdirs, g, dependency);
+  
+  for(size_t i = 0; i<g.size(); i++){
+    area[i] = flowdirs[i] == flowdir_nodata ? area_nodata : 0;
+  }
+
+  for(size_t i = 0; i<g.size(); i++){
+    if(dependency[i] == 0 && flowdirs[i] != flowdir_nodata)
+      sources.push(i);
+  }
+      
+  while(sources.size()>0){
+    size_t i = sources.front();
+    sources.pop();
+    
+    area[i]++;
+    
+    int n = flowdirs[i];
+    
+    if(!g.inside(g.row(i)+dy[n], g.col(i)+dx[n]))
+      continue;
+    
+    size_t ni = i + g.offset[n];
+    
+    if(flowdirs[ni] == flowdir_nodata)
+      continue;
+    
+    area[ni] += area[i];
+    
+    if(--dependency[ni] == 0)
+      sources.push(ni);
+  }
+}
+
+template <int FTYPE>
+static NumericMatrix d8_flow_accum_t(Matrix<FTYPE> flowdirs){
+  
+  grid g(flowdirs.nrow(), flowdirs.ncol());
+  NumericMatrix area(flowdirs.nrow(), flowdirs.ncol());
+  vector<unsigned char> dependency;
+  
+  d8_flow_accum_q(flowdirs.begin(), g, area.begin(), dependency);
+
+  return area;
+
+}
+
+//' Function for determining d8 flow accumulation (RichDEM)
+//'
+//' @param flowdirs The d8 pointer flow direction raster, an integer or raw matrix
+//' @return a flow accumulation raster
+// [[Rcpp::export]]
+NumericMatrix d8_flow_accum(SEXP flowdirs){
+  switch(TYPEOF(flowdirs)){
+  case RAWSXP:
+    return d8_flow_accum_t<RAWSXP>(flowdirs);
+  default:
+    return d8_flow_accum_t<INTSXP>(flowdirs);
+  }
+}
+
+// Number of layers of weights given as a matrix, or an array with one slice per layer, with the rows and columns of the grid
+static size_t weight_layers(NumericVector weights, const grid& g){
+  
+  IntegerVector dim = weights.hasAttribute("dim") ? IntegerVector(weights.attr("dim")) : IntegerVector(0);
+  
+  if(dim.size() < 2 || dim.size() > 3 || dim[0] != g.nrow || dim[1] != g.ncol || weights.size() == 0)
+    stop("weights must be a matrix or an array with the rows and columns of the flow directions and one or more layers");
+  
+  return weights.size() / g.size();
+}
+
+// Weighted flow accumulation of K layers in one sweep (as d8_flow_accum_t).
+// The layers are interleaved while sweeping, so the K values of a cell and of its downstream neighbour are each 
+// read from one place in memory, and the dependency order is only traversed once for all layers.
+template <int FTYPE>
+static NumericVector d8_weighted_flow_accum_t(Matrix<FTYPE> flowdirs, NumericVector weights){
+  
+  grid g(flowdirs.nrow(), flowdirs.ncol());
+  
+  size_t K = weight_layers(weights, g);
+  
+  vector<double> acc(g.size()*K);
+  for(size_t k = 0; k<K; k++){
+    const double* w = weights.begin() + k*g.size();
+    for(size_t i = 0; i<g.size(); i++)
+      acc[i*K + k] = w[i];
+  }
+  
+  vector<unsigned char> dependency;
+  d8_dependencies(flowdirs.begin(), g, dependency);
+  std::queue<size_t> sources;
+  
+  for(size_t i = 0; i<g.size(); i++){
+    if(dependency[i] == 0 && flowdirs[i] != flowdir_nodata)
+      sources.push(i);
+  }
+  
+  while(sources.size()>0){
+    size_t i = sources.front();
+    sources.pop();
+    
+    int n = flowdirs[i];
+    
+    if(!g.inside(g.row(i)+dy[n], g.col(i)+dx[n]))
+      continue;
+    
+    size_t ni = i + g.offset[n];
+    
+    if(flowdirs[ni] == flowdir_nodata)
+      continue;
+    
+    const double* from = &acc[i*K];
+    double* to = &acc[ni*K];
+    for(size_t k = 0; k<K; k++)
+      to[k] += from[k];
+    
+    if(--dependency[ni] == 0)
+      sources.push(ni);
+  }
+  
+  NumericVector result(weights.size());
+  result.attr("dim") = weights.attr("dim");
+  
+  for(size_t k = 0; k<K; k++){
+    double* out = result.begin() + k*g.size();
+    for(size_t i = 0; i<g.size(); i++)
+      out[i] = flowdirs[i] == flowdir_nodata ? NA_REAL : acc[i*K + k];
+  }
+  
+  return result;
+}
+
+//' Function for determining weighted d8 flow accumulation of several layers in one pass
+//'
+//' Each cell contributes its weight instead of 1, for all layers at once. Missing weights propagate downstream.
+//'
+//' @param flowdirs The d8 pointer flow direction raster, an integer or raw matrix
+//' @param weights Weights as a matrix, or an array with one slice per layer, with the rows and columns of flowdirs
+//' @return an array of weighted flow accumulation with the dimensions of weights, NA for nodata
+// [[Rcpp::export]]
+NumericVector d8_weighted_flow_accum(SEXP flowdirs, NumericVector weights){
+  switch(TYPEOF(flowdirs)){
+  case RAWSXP:
+    return d8_weighted_flow_accum_t<RAWSXP>(flowdirs, weights);
+  default:
+    return d8_weighted_flow_accum_t<INTSXP>(flowdirs, weights);
+  }
+}
+
+// Multiple flow directions
+
+// D-infinity flow directions (Tarboton 1997) are angles counterclockwise from east in radians, with dinf_noflow for cells 
+// without a downslope facet and NA for nodata. Facet k lies between the neighbours at angles k*pi/4 and (k+1)*pi/4,
+// dinf_d8 gives these neighbours as d8 directions.
+const int dinf_d8[9] = {5, 4, 3, 2, 1, 8, 7, 6, 5};
+double dinf_noflow = -1;
+
+// Contour length of the flow to cardinal and diagonal neighbours (Quinn et al. 1991), in cells
+const double mfd_contour[9] = {0, 0.5, 0.354, 0.5, 0.354, 0.5, 0.354, 0.5, 0.354};
+
+// Neighbour n of cell (r, c) lies within the grid and is not nodata
+template <typename T>
+static bool valid_neighbour(const T* dem, const grid& g, int r, int c, int n){
+  return g.inside(r+dy[n], c+dx[n]) && !is_nodata(dem[g.index(r, c) + g.offset[n]]);
+}
+
+// D-infinity flow direction of a cell, facets with a neighbour outside the grid or nodata are not used
+template <typename T>
+static double dinf_flowdir_cell(const T* dem, const grid& g, int r, int c){
+  
+  size_t i = g.index(r, c);
+  
+  if(is_nodata(dem[i]))
+    return NA_REAL;
+  
+  double smax = 0;
+  double angle = dinf_noflow;
+  
+  for(int k = 0; k < 8; k++){
+    int n1 = dinf_d8[2*((k+1)/2)]; // Cardinal neighbour
+    int n2 = dinf_d8[2*(k/2)+1];   // Diagonal neighbour
+    
+    if(!valid_neighbour(dem, g, r, c, n1) || !valid_neighbour(dem, g, r, c, n2))
+      continue;
+    
+    double e0 = dem[i];
+    double e1 = dem[i + g.offset[n1]];
+    double e2 = dem[i + g.offset[n2]];
+    
+    double s1 = e0-e1;
+    double s2 = e1-e2;
+    double facet_r = atan2(s2, s1);
+    double s;
+    
+    if(facet_r < 0){
+      facet_r = 0;
+      s = s1;
+    } else if(facet_r > M_PI/4){
+      facet_r = M_PI/4;
+      s = (e0-e2)/M_SQRT2;
+    } else {
+      s = sqrt(s1*s1 + s2*s2);
+    }
+    
+    if(s > smax){
+      smax = s;
+      angle = ((k+1)/2)*M_PI/2 + (k%2 == 0 ? facet_r : -facet_r);
+    }
+  }
+  
+  return angle >= 2*M_PI ? angle - 2*M_PI : angle;
+}
+
+// Neighbours receiving flow from a cell with D-infinity flow direction angle, as d8 directions with their fraction of the flow.
+// Returns the number of receivers (0 to 2), receivers with no flow, outside the grid or nodata are left out.
+template <typename T>
+static int dinf_receivers(const T* angles, const grid& g, int r, int c, int* n, double* f){
+  
+  double angle = angles[g.index(r, c)];
+  
+  if(ISNAN(angle) || angle < 0)
+    return 0;
+  
+  double sector = angle/(M_PI/4);
+  int k = min((int) sector, 7);
+  double fk = sector - k;
+  
+  int m = 0;
+  if(fk < 1 && valid_neighbour(angles, g, r, c, dinf_d8[k])){
+    n[m] = dinf_d8[k];
+    f[m++] = 1-fk;
+  }
+  if(fk > 0 && valid_neighbour(angles, g, r, c, dinf_d8[k+1])){
+    n[m] = dinf_d8[k+1];
+    f[m++] = fk;
+  }
+  
+  return m;
+}
+
+// Neighbours receiving flow from a cell with multiple flow directions, all lower neighbours weighted by (tan b)^p * L
+// (Quinn et al. 1991, with the exponent p of Freeman 1991). Returns the number of receivers.
+template <typename T>
+static int mfd_receivers(const T* dem, const grid& g, int r, int c, double exponent, int* n, double* f){
+  
+  size_t i = g.index(r, c);
+  
+  if(is_nodata(dem[i]))
+    return 0;
+  
+  int m = 0;
+  double total = 0;
+  
+  for(int k = 1; k <= 8; k++){
+    if(!valid_neighbour(dem, g, r, c, k))
+      continue;
+    
+    double drop = (double) dem[i] - dem[i + g.offset[k]];
+    
+    if(drop <= 0)
+      continue;
+    
+    double tan_b = k%2 == 1 ? drop : drop/M_SQRT2;
+    n[m] = k;
+    f[m] = pow(tan_b, exponent)*mfd_contour[k];
+    total += f[m++];
+  }
+  
+  for(int k = 0; k < m; k++)
+    f[k] /= total;
+  
+  return m;
+}
+
+// Routers for the flow accumulation, giving the receivers of a cell for D-infinity or multiple flow directions, 
+// and their number without the fractions of the flow
+template <typename T>
+struct dinf_router {
+  const T* angles;
+  
+  int operator()(const grid& g, int r, int c, int* n, double* f) const { return dinf_receivers(angles, g, r, c, n, f); }
+  bool nodata(size_t i) const { return ISNAN(angles[i]); }
+  
+  int count(const grid& g, int r, int c) const {
+    int n[2];
+    double f[2];
+    return dinf_receivers(angles, g, r, c, n, f);
+  }
+};
+
+template <typename T>
+struct mfd_router {
+  const T* dem;
+  double exponent;
+  
+  int operator()(const grid& g, int r, int c, int* n, double* f) const { return mfd_receivers(dem, g, r, c, exponent, n, f); }
+  bool nodata(size_t i) const { return is_nodata(dem[i]); }
+  
+  int count(const grid& g, int r, int c) const {
+    size_t i = g.index(r, c);
+    if(is_nodata(dem[i]))
+      return 0;
+    int m = 0;
+    for(int k = 1; k <= 8; k++)
+      m += valid_neighbour(dem, g, r, c, k) && (double) dem[i] - dem[i + g.offset[k]] > 0;
+    return m;
+  }
+};
+
+// Receivers of all cells in compressed sparse row format, cell i sends fraction[k] of its flow to its neighbour dir[k] 
+// for start[i] <= k < start[i+1]
+struct flow_split {
+  vector<size_t> start;
+  vector<unsigned char> dir;
+  vector<double> fraction;
+};
+
+// Workers for a range of columns, counting the receivers of each cell (stored at start[i+1]) and storing the receivers with their fractions
+template <typename R>
+struct receiver_count_worker : public RcppParallel::Worker {
+  
+  const R& router;
+  const grid& g;
+  flow_split& split;
+  
+  receiver_count_worker(const R& router, const grid& g, flow_split& split): router(router), g(g), split(split){}
+  
+  void operator()(size_t begin, size_t end){
+    for(int c = begin; c < (int) end; c++){
+      for(int r = 0; r < g.nrow; r++)
+        split.start[g.index(r, c) + 1] = router.count(g, r, c);
+    }
+  }
+};
+
+template <typename R>
+struct receiver_worker : public RcppParallel::Worker {
+  
+  const R& router;
+  const grid& g;
+  flow_split& split;
+  
+  receiver_worker(const R& router, const grid& g, flow_split& split): router(router), g(g), split(split){}
+  
+  void operator()(size_t begin, size_t end){
+    int n[8];
+    double f[8];
+    for(int c = begin; c < (int) end; c++){
+      for(int r = 0; r < g.nrow; r++){
+        size_t k = split.start[g.index(r, c)];
+        int m = router(g, r, c, n, f);
+        for(int j = 0; j < m; j++){
+          split.dir[k + j] = n[j];
+          split.fraction[k + j] = f[j];
+        }
+      }
+    }
+  }
+};
+
+// Worker counting the upstream neighbours of each cell in a range of columns, i.e. the neighbours that route flow into it
+struct upstream_count_worker : public RcppParallel::Worker {
+  
+  const flow_split& split;
+  const grid& g;
+  unsigned char* dependency;
+  
+  upstream_count_worker(const flow_split& split, const grid& g, unsigned char* dependency): split(split), g(g), dependency(dependency){}
+  
+  void operator()(size_t begin, size_t end){
+    for(int c = begin; c < (int) end; c++){
+      for(int r = 0; r < g.nrow; r++){
+        size_t i = g.index(r, c);
+        for(int k = 1; k <= 8; k++){
+          if(!g.inside(r+dy[k], c+dx[k]))
+            continue;
+          size_t ni = i + g.offset[k];
+          for(size_t j = split.start[ni]; j < split.start[ni+1]; j++)
+            dependency[i] += split.dir[j] == d8_inv[k];
+        }
+      }
+    }
+  }
+};
+
+// Flow accumulation with divergent flow, in a topological sweep from the cells without upstream neighbours (as d8_flow_accum)
+// The receivers of each cell and their fractions are determined once, in parallel over columns, and kept for the sweep 
+// (8 bytes per cell and 9 bytes per receiver). The sweep itself is serial: unlike d8 flow (Barnes 2017), flow from a cell on 
+// the perimeter of a tile spreads to many perimeter cells, so tiles can not be linked through single downstream perimeter cells.
+template <typename R>
+static NumericMatrix divergent_flow_accum(const R& router, int nrow, int ncol, int threads){
+  
+  if(threads < 1)
+    stop("threads must be positive");
+  
+  grid g(nrow, ncol);
+  flow_split split;
+  vector<unsigned char> dependency(g.size()); // At most 8 upstream cells
+  NumericMatrix area(nrow, ncol);
+  double area_nodata = -1;
+  
+  split.start.assign(g.size()+1, 0);
+  receiver_count_worker<R> count_worker(router, g, split);
+  RcppParallel::parallelFor(0, ncol, count_worker, 64, threads);
+  
+  for(size_t i = 0; i < g.size(); i++)
+    split.start[i+1] += split.start[i];
+  
+  split.dir.resize(split.start[g.size()]);
+  split.fraction.resize(split.start[g.size()]);
+  receiver_worker<R> worker(router, g, split);
+  RcppParallel::parallelFor(0, ncol, worker, 64, threads);
+  
+  upstream_count_worker dependency_worker(split, g, dependency.data());
+  RcppParallel::parallelFor(0, ncol, dependency_worker, 64, threads);
+  
+  std::queue<size_t> sources;
+  
+  for(size_t i = 0; i < g.size(); i++){
+    if(router.nodata(i))
+      area[i] = area_nodata;
+    else if(dependency[i] == 0)
+      sources.push(i);
+  }
+  
+  while(sources.size()>0){
+    size_t i = sources.front();
+    sources.pop();
+    
+    area[i]++;
+    
+    for(size_t k = split.start[i]; k < split.start[i+1]; k++){
+      size_t ni = i + g.offset[split.dir[k]];
+      area[ni] += split.fraction[k]*area[i];
+      
+      if(--dependency[ni] == 0)
+        sources.push(ni);
+    }
+  }
+  
+  return area;
+}
+
+// Worker determining D-infinity flow directions for a range of columns
+template <int RTYPE>
+struct dinf_flowdir_worker : public RcppParallel::Worker {
+  
+  typedef typename traits::storage_type<RTYPE>::type T;
+  
+  RcppParallel::RMatrix<T> dem;
+  RcppParallel::RMatrix<double> angles;
+  
+  dinf_flowdir_worker(Matrix<RTYPE> dem, NumericMatrix angles): dem(dem), angles(angles){}
+  
+  void operator()(size_t begin, size_t end){
+    grid g(dem.nrow(), dem.ncol());
+    for(size_t c = begin; c < end; c++){
+      for(int r = 0; r < g.nrow; r++)
+        angles(r, c) = dinf_flowdir_cell(dem.begin(), g, r, c);
+    }
+  }
+};
+
+template <int RTYPE>
+static NumericMatrix dinf_flow_directions_t(Matrix<RTYPE> dem, int threads){
+  
+  if(threads < 1)
+    stop("threads must be positive");
+  
+  NumericMatrix angles(dem.nrow(), dem.ncol());
+  
+  dinf_flowdir_worker<RTYPE> worker(dem, angles);
+  RcppParallel::parallelFor(0, dem.ncol(), worker, 64, threads);
+  
+  return angles;
+}
+
+//' Function for determining D-infinity flow directions in:
+//' "Tarboton, D.G., 1997. A new method for the determination of flow directions and upslope areas in grid digital elevation models. Water Resources Research 33, 309–319. doi:10.1029/96WR03137"
+//'
+//' The flow direction is the steepest downslope direction on the eight triangular facets around the cell, as an angle.
+//' Cells are assumed to be square. Columns of the DEM are processed in parallel.
+//'
+//' @param dem The input digital elevation model (DEM), an integer or double matrix
+//' @param threads The number of threads
+//' @return a D-infinity flow direction raster, angles in radians counterclockwise from east, -1 for cells without a downslope facet and NA for nodata
+// [[Rcpp::export]]
+SEXP dinf_flow_directions(SEXP dem, int threads = 1){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return dinf_flow_directions_t<INTSXP>(dem, threads);
+  case REALSXP:
+    return dinf_flow_directions_t<REALSXP>(dem, threads);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
+
+//' Function for determining D-infinity flow accumulation (Tarboton 1997)
+//'
+//' The flow of each cell is split between the two neighbours on either side of its flow direction.
+//'
+//' @param angles The D-infinity flow direction raster from dinf_flow_directions
+//' @param threads The number of threads
+//' @return a flow accumulation raster
+// [[Rcpp::export]]
+NumericMatrix dinf_flow_accum(NumericMatrix angles, int threads = 1){
+  
+  dinf_router<double> router = {angles.begin()};
+  
+  return divergent_flow_accum(router, angles.nrow(), angles.ncol(), threads);
+}
+
+template <int RTYPE>
+static NumericMatrix mfd_flow_accum_t(Matrix<RTYPE> dem, double exponent, int threads){
+  
+  typedef typename traits::storage_type<RTYPE>::type T;
+  
+  mfd_router<T> router = {dem.begin(), exponent};
+  
+  return divergent_flow_accum(router, dem.nrow(), dem.ncol(), threads);
+}
+
+//' Function for determining multiple flow direction (MFD) flow accumulation in:
+//' "Quinn, P., Beven, K., Chevallier, P., Planchon, O., 1991. The prediction of hillslope flow paths for distributed hydrological modelling using digital terrain models. Hydrological Processes 5, 59–79. doi:10.1002/hyp.3360050106"
+//' "Freeman, T.G., 1991. Calculating catchment area with divergent flow based on a regular grid. Computers & Geosciences 17, 413–422. doi:10.1016/0098-3004(91)90048-I"
+//'
+//' The flow of each cell is split between all lower neighbours in proportion to (tan b)^p * L, where b is the slope to the neighbour and L the contour length.
+//' The DEM should be filled with a gradient over flat areas (pf_eps_barnes2014), as flow stops at cells without lower neighbours. Cells are assumed to be square.
+//'
+//' @param dem The input digital elevation model (DEM), an integer or double matrix
+//' @param exponent The exponent p, 1 as in Quinn et al. (1991) or 1.1 as in Freeman (1991)
+//' @param threads The number of threads
+//' @return a flow accumulation raster
+// [[Rcpp::export]]
+NumericMatrix mfd_flow_accum(SEXP dem, double exponent = 1.1, int threads = 1){
+  switch(TYPEOF(dem)){
+  case INTSXP:
+    return mfd_flow_accum_t<INTSXP>(dem, exponent, threads);
+  case REALSXP:
+    return mfd_flow_accum_t<REALSXP>(dem, exponent, threads);
+  default:
+    stop("dem must be an integer or double matrix");
+  }
+}
+
+// Tiled flow accumulation
+
+// Flow accumulation within a tile (as d8_flow_accum), flow leaving the tile is not followed.
+// Flow entering from other tiles (inflow, in perimeter order) is added to the perimeter cells it enters through.
+// Cells are appended to order when they are finalised, which gives a topological order of the tile.
+template <typename F>
+static void d8_tile_accum(const F* flowdirs, int ld, const tile& t, const double* inflow, double* area, int ald, vector<int>* order){
+  
+  std::queue<int> sources;
+  grid g(t.nrow, t.ncol);
+  grid m(ld, t.ncol), a(ald, t.ncol); // The tile in the flow directions and in area, only used for index()
+  vector<unsigned char> dependency(g.size());
+  double area_nodata = -1;
+  
+  for(int c = 0; c < t.ncol; c++){
+    for(int r = 0; r < t.nrow; r++){
+      int n = flowdirs[m.index(r, c)];
+      if(n == flowdir_nodata){
+        area[a.index(r, c)] = area_nodata;
+        continue;
+      }
+      
+      area[a.index(r, c)] = 0;
+      
+      if(!g.inside(r+dy[n], c+dx[n]))
+        continue;
+      
+      ++dependency[g.index(r, c) + g.offset[n]];
+    }
+  }
+  
+  if(inflow){
+    for(int i = 0; i < t.perimeter_size(); i++){
+      cell p = t.perimeter_cell(i);
+      if(flowdirs[m.index(p.r, p.c)] != flowdir_nodata)
+        area[a.index(p.r, p.c)] += inflow[i];
+    }
+  }
+  
+  for(int c = 0; c < t.ncol; c++){
+    for(int r = 0; r < t.nrow; r++){
+      if(dependency[g.index(r, c)] == 0 && flowdirs[m.index(r, c)] != flowdir_nodata)
+        sources.push(g.index(r, c));
+    }
+  }
+  
+  while(sources.size()>0){
+    int i = sources.front();
+    sources.pop();
+    
+    int r = g.row(i);
+    int c = g.col(i);
+    
+    area[a.index(r, c)]++;
+    
+    if(order)
+      order->push_back(i);
+    
+    int n = flowdirs[m.index(r, c)];
+    int nc = c+dx[n];
+    int nr = r+dy[n];
+    
+    if(!g.inside(nr, nc))
+      continue;
+    
+    if(flowdirs[m.index(nr, nc)] == flowdir_nodata)
+      continue;
+    
+    area[a.index(nr, nc)] += area[a.index(r, c)];
+    
+    if(--dependency[i + g.offset[n]] == 0)
+      sources.push(i + g.offset[n]);
+  }
+}
+
+// Stage 1 of the tiled flow accumulation (Barnes 2017)
+// For each perimeter cell the local flow accumulation is stored, together with the next perimeter cell
+// downstream within the tile (link, -1 if flow ends in or leaves the tile) and its flow direction.
+template <typename F>
+static void d8_tile_links(const F* flowdirs, int ld, const tile& t, vector<double>& perimeter_area, vector<int>& perimeter_link, vector<int>& perimeter_dir){
+  
+  grid g(t.nrow, t.ncol);
+  grid m(ld, t.ncol); // The tile in the flow directions, only used for index()
+  vector<double> area(g.size());
+  vector<int> order;
+  order.reserve(g.size());
+  
+  d8_tile_accum(flowdirs, ld, t, NULL, area.data(), t.nrow, &order);
+  
+  // Visiting cells downstream before upstream, the next perimeter cell is inherited from the downstream cell
+  vector<int> next(g.size(), -1);
+  for(int k = order.size()-1; k >= 0; k--){
+    int i = order[k];
+    int r = g.row(i);
+    int c = g.col(i);
+    int n = flowdirs[m.index(r, c)];
+    int nc = c+dx[n];
+    int nr = r+dy[n];
+    
+    if(!g.inside(nr, nc))
+      continue;
+    
+    if(flowdirs[m.index(nr, nc)] == flowdir_nodata)
+      continue;
+    
+    size_t ni = i + g.offset[n];
+    next[i] = t.on_perimeter(nr, nc) ? ni : next[ni];
+  }
+  
+  perimeter_area.resize(t.perimeter_size());
+  perimeter_link.resize(t.perimeter_size());
+  perimeter_dir.resize(t.perimeter_size());
+  
+  for(int i = 0; i < t.perimeter_size(); i++){
+    cell p = t.perimeter_cell(i);
+    int j = next[g.index(p.r, p.c)];
+    perimeter_area[i] = area[g.index(p.r, p.c)];
+    perimeter_link[i] = j == -1 ? -1 : t.perimeter_id(g.row(j), g.col(j));
+    perimeter_dir[i] = flowdirs[m.index(p.r, p.c)];
+  }
+}
+
+// Stage 2 of the tiled flow accumulation (Barnes 2017)
+// Flow is routed through the graph of perimeter cells, linked within tiles and by flow directions across tiles.
+// Returns the flow entering each perimeter cell from other tiles, in tile order.
+static vector<double> d8_link_inflow(const tiling& tl, const vector<vector<double>>& perimeter_area, const vector<vector<int>>& perimeter_link, const vector<vector<int>>& perimeter_dir){
+  
+  vector<int> offset(tl.size()+1, 0);
+  for(int i = 0; i < tl.size(); i++){
+    offset[i+1] = offset[i] + tl.get(i).perimeter_size();
+  }
+  int nnodes = offset[tl.size()];
+  
+  grid g(tl.nrow, tl.ncol);
+  vector<int> cross(nnodes, -1);
+  vector<int> link(nnodes, -1);
+  vector<int> dependency(nnodes, 0);
+  vector<double> area(nnodes);
+  
+  for(int i = 0; i < tl.size(); i++){
+    tile t = tl.get(i);
+    for(int p = 0; p < t.perimeter_size(); p++){
+      int node = offset[i] + p;
+      area[node] = perimeter_area[i][p];
+      
+      if(perimeter_link[i][p] != -1){
+        link[node] = offset[i] + perimeter_link[i][p];
+        ++dependency[link[node]];
+        continue;
+      }
+      
+      int n = perimeter_dir[i][p];
+      if(n == flowdir_nodata)
+        continue;
+      
+      cell pc = t.perimeter_cell(p);
+      int nc = t.c0+pc.c+dx[n];
+      int nr = t.r0+pc.r+dy[n];
+      
+      if(!g.inside(nr, nc))
+        continue;
+      
+      int j = tl.tile_of(nr, nc);
+      if(j == i)
+        continue;
+      
+      tile u = tl.get(j);
+      int q = u.perimeter_id(nr-u.r0, nc-u.c0);
+      
+      if(perimeter_dir[j][q] == flowdir_nodata)
+        continue;
+      
+      cross[node] = offset[j] + q;
+      ++dependency[cross[node]];
+    }
+  }
+  
+  // Flow passing through perimeter cells from other tiles, and the part of it entering directly across the tile edge
+  vector<double> through(nnodes, 0);
+  vector<double> inflow(nnodes, 0);
+  std::queue<int> sources;
+  
+  for(int i = 0; i < nnodes; i++){
+    if(dependency[i] == 0)
+      sources.push(i);
+  }
+  
+  while(sources.size()>0){
+    int i = sources.front();
+    sources.pop();
+    
+    int j;
+    if(cross[i] != -1){
+      j = cross[i];
+      inflow[j] += area[i] + through[i];
+      through[j] += area[i] + through[i];
+    } else if(link[i] != -1){
+      j = link[i];
+      through[j] += through[i];
+    } else {
+      continue;
+    }
+    
+    if(--dependency[j] == 0)
+      sources.push(j);
+  }
+  
+  return inflow;
+}
+
+//' Stage 1 of the tiled d8 flow accumulation for a single tile, used when processing rasters tile by tile from disk
+//' "Barnes, R., 2017. Parallel non-divergent flow accumulation for trillion cell digital elevation models on desktops or clusters. Environmental Modelling & Software 92, 202–212. doi:10.1016/j.envsoft.2017.02.022"
+//'
+//' @param flowdirs One tile of the d8 pointer flow direction raster
+//' @return List with the local flow accumulation (area), the next perimeter cell downstream (link) and the flow direction (dir) of the tile perimeter cells
+// [[Rcpp::export]]
+List d8_tile_links_barnes2017(IntegerMatrix flowdirs){
+  
+  tile t(0, 0, flowdirs.nrow(), flowdirs.ncol());
+  vector<double> perimeter_area;
+  vector<int> perimeter_link;
+  vector<int> perimeter_dir;
+  
+  d8_tile_links(flowdirs.begin(), flowdirs.nrow(), t, perimeter_area, perimeter_link, perimeter_dir);
+  
+  List result = List::create(_["area"] = wrap(perimeter_area), _["link"] = wrap(perimeter_link), _["dir"] = wrap(perimeter_dir));
+  
+  return(result);
+}
+
+//' Stage 2 of the tiled d8 flow accumulation, routing flow between tiles
+//'
+//' @param tiles List with the result of d8_tile_links_barnes2017 for each tile, tiles ordered column-major
+//' @param nrow Number of rows in the raster
+//' @param ncol Number of columns in the raster
+//' @param tile_nrow Number of rows in each tile
+//' @param tile_ncol Number of columns in each tile
+//' @return List with the flow entering the perimeter cells of each tile from other tiles
+// [[Rcpp::export]]
+List d8_link_inflow_barnes2017(List tiles, int nrow, int ncol, int tile_nrow, int tile_ncol){
+  
+  tiling tl(nrow, ncol, tile_nrow, tile_ncol);
+  
+  if(tiles.size() != tl.size())
+    stop("Number of tiles does not match the tiling of the raster");
+  
+  vector<vector<double>> perimeter_area(tl.size());
+  vector<vector<int>> perimeter_link(tl.size());
+  vector<vector<int>> perimeter_dir(tl.size());
+  
+  for(int i = 0; i < tl.size(); i++){
+    List tile_links = tiles[i];
+    NumericVector area = tile_links["area"];
+    IntegerVector link = tile_links["link"];
+    IntegerVector dir = tile_links["dir"];
+    
+    if(area.size() != tl.get(i).perimeter_size())
+      stop("Perimeter of tile does not match the tiling of the raster");
+    
+    perimeter_area[i].assign(area.begin(), area.end());
+    perimeter_link[i].assign(link.begin(), link.end());
+    perimeter_dir[i].assign(dir.begin(), dir.end());
+  }
+  
+  vector<double> inflow = d8_link_inflow(tl, perimeter_area, perimeter_link, perimeter_dir);
+  
+  List result(tl.size());
+  size_t offset = 0;
+  for(int i = 0; i < tl.size(); i++){
+    size_t size = tl.get(i).perimeter_size();
+    result[i] = NumericVector(inflow.begin() + offset, inflow.begin() + offset + size);
+    offset += size;
+  }
+  
+  return(result);
+}
+
+//' Stage 3 of the tiled d8 flow accumulation for a single tile
+//'
+//' @param flowdirs One tile of the d8 pointer flow direction raster
+//' @param inflow Flow entering the tile perimeter cells from d8_link_inflow_barnes2017
+//' @return a flow accumulation raster for the tile
+// [[Rcpp::export]]
+NumericMatrix d8_tile_flow_accum_barnes2017(IntegerMatrix flowdirs, NumericVector inflow){
+  
+  tile t(0, 0, flowdirs.nrow(), flowdirs.ncol());
+  
+  if(inflow.size() != t.perimeter_size())
+    stop("Length of inflow does not match the perimeter of the tile");
+  
+  NumericMatrix area(flowdirs.nrow(), flowdirs.ncol());
+  
+  d8_tile_accum(flowdirs.begin(), flowdirs.nrow(), t, inflow.begin(), area.begin(), area.nrow(), NULL);
+  
+  return area;
+}
+
+// Workers running stage 1 and stage 3 of the tiled flow accumulation on a range of tiles
+template <int FTYPE>
+struct d8_links_worker : public RcppParallel::Worker {
+  
+  RcppParallel::RMatrix<typename traits::storage_type<FTYPE>::type> flowdirs;
+  const tiling& tl;
+  vector<vector<double>>& perimeter_area;
+  vector<vector<int>>& perimeter_link;
+  vector<vector<int>>& perimeter_dir;
+  
+  d8_links_worker(Matrix<FTYPE> flowdirs, const tiling& tl, vector<vector<double>>& perimeter_area, vector<vector<int>>& perimeter_link, vector<vector<int>>& perimeter_dir): 
+    flowdirs(flowdirs), tl(tl), perimeter_area(perimeter_area), perimeter_link(perimeter_link), perimeter_dir(perimeter_dir){}
+  
+  void operator()(size_t begin, size_t end){
+    for(size_t i = begin; i < end; i++){
+      tile t = tl.get(i);
+      d8_tile_links(flowdirs.begin() + (size_t) t.c0*flowdirs.nrow() + t.r0, flowdirs.nrow(), t, perimeter_area[i], perimeter_link[i], perimeter_dir[i]);
+    }
+  }
+};
+
+template <int FTYPE>
+struct d8_accum_worker : public RcppParallel::Worker {
+  
+  RcppParallel::RMatrix<typename traits::storage_type<FTYPE>::type> flowdirs;
+  RcppParallel::RMatrix<double> area;
+  const tiling& tl;
+  const vector<double>& inflow;
+  const vector<int>& offset;
+  
+  d8_accum_worker(Matrix<FTYPE> flowdirs, NumericMatrix area, const tiling& tl, const vector<double>& inflow, const vector<int>& offset): 
+    flowdirs(flowdirs), area(area), tl(tl), inflow(inflow), offset(offset){}
+  
+  void operator()(size_t begin, size_t end){
+    for(size_t i = begin; i < end; i++){
+      tile t = tl.get(i);
+      size_t start = (size_t) t.c0*flowdirs.nrow() + t.r0;
+      d8_tile_accum(flowdirs.begin() + start, flowdirs.nrow(), t, &inflow[offset[i]], area.begin() + start, area.nrow(), NULL);
+    }
+  }
+};
+
+template <int FTYPE>
+static NumericMatrix d8_parallel_flow_accum_barnes2017_t(Matrix<FTYPE> flowdirs, int tile_size, int threads){
+  
+  if(tile_size < 1)
+    stop("tile_size must be positive");
+  
+  tiling tl(flowdirs.nrow(), flowdirs.ncol(), tile_size, tile_size);
+  
+  vector<vector<double>> perimeter_area(tl.size());
+  vector<vector<int>> perimeter_link(tl.size());
+  vector<vector<int>> perimeter_dir(tl.size());
+  
+  d8_links_worker<FTYPE> links_worker(flowdirs, tl, perimeter_area, perimeter_link, perimeter_dir);
+  RcppParallel::parallelFor(0, tl.size(), links_worker, 1, threads);
+  
+  vector<double> inflow = d8_link_inflow(tl, perimeter_area, perimeter_link, perimeter_dir);
+  
+  vector<int> offset(tl.size(), 0);
+  for(int i = 1; i < tl.size(); i++){
+    offset[i] = offset[i-1] + tl.get(i-1).perimeter_size();
+  }
+  
+  NumericMatrix area(flowdirs.nrow(), flowdirs.ncol());
+  
+  d8_accum_worker<FTYPE> accum_worker(flowdirs, area, tl, inflow, offset);
+  RcppParallel::parallelFor(0, tl.size(), accum_worker, 1, threads);
+  
+  return area;
+}
+
+//' Parallel d8 flow accumulation in:
+//' "Barnes, R., 2017. Parallel non-divergent flow accumulation for trillion cell digital elevation models on desktops or clusters. Environmental Modelling & Software 92, 202–212. doi:10.1016/j.envsoft.2017.02.022"
+//'
+//' The raster is split into tiles which are accumulated independently, flow is routed between the tiles and the tiles are accumulated again with their inflow.
+//' The result is identical to d8_flow_accum.
+//'
+//' @param flowdirs The d8 pointer flow direction raster, an integer or raw matrix
+//' @param tile_size The number of rows and columns in each tile
+//' @param threads The number of threads
+//' @return a flow accumulation raster
+// [[Rcpp::export]]
+NumericMatrix d8_parallel_flow_accum_barnes2017(SEXP flowdirs, int tile_size, int threads){
+  switch(TYPEOF(flowdirs)){
+  case RAWSXP:
+    return d8_parallel_flow_accum_barnes2017_t<RAWSXP>(flowdirs, tile_size, threads);
+  default:
+    return d8_parallel_flow_accum_barnes2017_t<INTSXP>(flowdirs, tile_size, threads);
+  }
+}
+
+// Watershed delineation
+
+// Labels of the watershed cells in an integer matrix of the grid, the result or a scratch grid for tracing polygons
+struct label_matrix {
+  int* labels;
+  int get(size_t i) const { return labels[i]; }
+  void set(size_t i, int label){ labels[i] = label; }
+};
+
+// Watersheds are expanded upstream from the outlets in breadth-first order, the outlets themselves are not labelled.
+// Nested watersheds are expanded from all outlets at once and each cell takes the label of the first front reaching it.
+template <typename F, class L>
+static void d8_watershed_expand(const F* flowdirs, const grid& g, NumericMatrix target_rc, bool nested, L& watershed){
+
+  std::queue<cellz<double>> expansion;
+  int watershed_nodata = 0;
+  
+  for(int r = 0; r < target_rc.nrow(); r++){
+    expansion.push(cellz<double>(target_rc(r, 0)-1, target_rc(r, 1)-1, target_rc(r, 2)));
+  }
+  
+  while(expansion.size()>0){
+    cellz<double> c = expansion.front();
+    expansion.pop();
+    
+    for(int n = 1; n <= 8; n++){
+      
+      int nc = c.c+dx[n];
+      int nr = c.r+dy[n];
+      double label = 1;
+      
+      if(nested){
+        label = c.z;
+      }
+      
+      if(!g.inside(nr, nc))
+        continue;
+      
+      size_t ni = g.index(nr, nc);
+      
+      if(flowdirs[ni] == flowdir_nodata)
+        continue;
+      
+      else if(watershed.get(ni) == watershed_nodata && n == d8_inv[flowdirs[ni]]){
+        expansion.push(cellz<double>(nr, nc, label));
+        watershed.set(ni, label);
+      }
+    }
+  }
+}
+
+// Subbasin of an outlet in the hierarchy of nested watersheds
+struct subbasin {
+  int downstream = 0;   // Label of the nearest outlet downstream, 0 if none
+  double local = 0;     // Cells draining to the outlet without passing another outlet
+  double cumulative = 0;
+};
+
+// Each cell is labelled with its nearest outlet downstream, including the outlet cells themselves. The flow paths from the outlets 
+// are first followed downstream to the cells where flow leaves the grid or ends, and the watersheds are then expanded upstream 
+// from these cells in a single pass, taking the label of each outlet passed. Until an outlet is passed, only the cells on the flow 
+// paths are expanded. Subbasins are found in downstream to upstream order, so their downstream subbasin is always known first.
+template <typename F, class L>
+static std::map<int, subbasin> d8_watershed_hierarchy_expand(const F* flowdirs, const grid& g, NumericMatrix target_rc, L& watershed){
+  
+  unordered_map<size_t, int> outlets;
+  for(int r = 0; r < target_rc.nrow(); r++){
+    outlets[g.index(target_rc(r, 0)-1, target_rc(r, 1)-1)] = target_rc(r, 2);
+  }
+  
+  // Flow paths from the outlets, ending in the roots of the expansion
+  bit_grid path(g);
+  vector<size_t> roots;
+  
+  for(auto& outlet : outlets){
+    size_t i = outlet.first;
+    while(!path[i]){
+      path.set(i);
+      int n = flowdirs[i];
+      if(n == flowdir_nodata || !g.inside(g.row(i)+dy[n], g.col(i)+dx[n])){
+        roots.push_back(i);
+        break;
+      }
+      i += g.offset[n];
+    }
+  }
+  
+  std::map<int, subbasin> subbasins;
+  vector<int> order;
+  std::queue<cellz<int>> expansion;
+  
+  for(size_t i : roots){
+    expansion.push(cellz<int>(g.row(i), g.col(i), 0));
+  }
+  
+  while(expansion.size()>0){
+    cellz<int> c = expansion.front();
+    expansion.pop();
+    
+    size_t i = g.index(c.r, c.c);
+    int label = c.z;
+    
+    auto outlet = outlets.find(i);
+    if(outlet != outlets.end() && outlet->second != label){
+      auto found = subbasins.insert({outlet->second, subbasin()});
+      if(found.second){
+        found.first->second.downstream = label;
+        order.push_back(outlet->second);
+      }
+      label = outlet->second;
+    }
+    
+    if(label != 0){
+      watershed.set(i, label);
+      subbasins[label].local++;
+    }
+    
+    for(int n = 1; n <= 8; n++){
+      
+      int nc = c.c+dx[n];
+      int nr = c.r+dy[n];
+      
+      if(!g.inside(nr, nc))
+        continue;
+      
+      size_t ni = g.index(nr, nc);
+      
+      if(flowdirs[ni] != flowdir_nodata && n == d8_inv[flowdirs[ni]] && (label != 0 || path[ni]))
+        expansion.push(cellz<int>(nr, nc, label));
+    }
+  }
+  
+  for(auto k = order.rbegin(); k != order.rend(); k++){
+    subbasin& s = subbasins[*k];
+    s.cumulative += s.local;
+    if(s.downstream != 0)
+      subbasins[s.downstream].cumulative += s.cumulative;
+  }
+  
+  return subbasins;
+}
+
+// Directed edge between two cell corners, with the labelled cell on the left
+struct ring_edge {
+  int c, r;   // Corner the edge starts at (column and row from the top left corner of the grid)
+  int dc, dr; // Direction of the edge
+};
+
+// Polygon rings around the cells of each label, traced along the cell edges with the labelled cells on the left.
+// Where cells touch only at a corner the ring turns left, so rings are split there and touch at most at corners. 
+// Each part of a label (cells connected across their sides) then has one outer ring, running counterclockwise in map 
+// coordinates, and its holes run clockwise. Holes are given the part of the cell on their left. Only the corners where 
+// a ring changes direction are kept, and rings are closed. Cells with label 0 are not labelled.
+static List label_rings(const grid& g, const int* labels){
+  
+  std::map<int, vector<ring_edge>> edges;
+  
+  // Sides of labelled cells facing a cell with another label, counterclockwise around the cell
+  const int side_dr[4] = {1, 0, -1, 0}, side_dc[4] = {0, 1, 0, -1}; // Neighbour across the side
+  const int start_r[4] = {1, 1, 0, 0}, start_c[4] = {0, 1, 1, 0};   // Corner the side starts at
+  const int dir_r[4] = {0, -1, 0, 1}, dir_c[4] = {1, 0, -1, 0};     // Direction of the side
+  
+  for(int c = 0; c < g.ncol; c++){
+    for(int r = 0; r < g.nrow; r++){
+      int label = labels[g.index(r, c)];
+      if(label == 0)
+        continue;
+      for(int s = 0; s < 4; s++){
+        int nr = r + side_dr[s], nc = c + side_dc[s];
+        if(g.inside(nr, nc) && labels[g.index(nr, nc)] == label)
+          continue;
+        edges[label].push_back({c + start_c[s], r + start_r[s], dir_c[s], dir_r[s]});
+      }
+    }
+  }
+  
+  // Parts of the labels, numbered from 1 in a grid that is only made when there are holes
+  vector<int> cell_part;
+  auto number_parts = [&](){
+    cell_part.assign(g.size(), 0);
+    vector<size_t> stack;
+    int parts = 0;
+    for(size_t i = 0; i < g.size(); i++){
+      if(labels[i] == 0 || cell_part[i] != 0)
+        continue;
+      cell_part[i] = ++parts;
+      stack.push_back(i);
+      while(stack.size()>0){
+        size_t j = stack.back();
+        stack.pop_back();
+        for(int n = 1; n <= 7; n += 2){
+          if(!g.inside(g.row(j)+dy[n], g.col(j)+dx[n]))
+            continue;
+          size_t nj = j + g.offset[n];
+          if(cell_part[nj] == 0 && labels[nj] == labels[i]){
+            cell_part[nj] = parts;
+            stack.push_back(nj);
+          }
+        }
+      }
+    }
+  };
+  
+  vector<int> id, part, hole, x, y;
+  
+  for(auto& label_edges : edges){
+    vector<ring_edge>& e = label_edges.second;
+    
+    // Edges leaving each corner, at most two where cells touch at a corner
+    unordered_map<long long, std::array<int, 2>> leaving;
+    auto corner = [&](int c, int r){ return (long long) r*(g.ncol+1) + c; };
+    for(size_t k = 0; k < e.size(); k++){
+      auto it = leaving.emplace(corner(e[k].c, e[k].r), std::array<int, 2>{{-1, -1}}).first;
+      it->second[it->second[0] == -1 ? 0 : 1] = k;
+    }
+    
+    vector<bool> used(e.size());
+    vector<vector<int>> ring_x, ring_y;
+    vector<double> ring_area;
+    vector<size_t> ring_cell; // A cell on the left of the ring
+    
+    for(size_t k0 = 0; k0 < e.size(); k0++){
+      if(used[k0])
+        continue;
+      
+      vector<int> rx, ry, rdc, rdr;
+      for(int k = k0; !used[k]; ){
+        used[k] = true;
+        rx.push_back(e[k].c);
+        ry.push_back(e[k].r);
+        rdc.push_back(e[k].dc);
+        rdr.push_back(e[k].dr);
+        
+        std::array<int, 2>& next = leaving[corner(e[k].c + e[k].dc, e[k].r + e[k].dr)];
+        int left_dc = e[k].dr, left_dr = -e[k].dc;
+        k = next[1] != -1 && e[next[1]].dc == left_dc && e[next[1]].dr == left_dr ? next[1] : next[0];
+      }
+      
+      vector<int> xs, ys;
+      for(size_t k = 0; k < rx.size(); k++){
+        size_t prev = k == 0 ? rx.size()-1 : k-1;
+        if(rdc[k] != rdc[prev] || rdr[k] != rdr[prev]){
+          xs.push_back(rx[k]);
+          ys.push_back(ry[k]);
+        }
+      }
+      
+      double area = 0;
+      for(size_t k = 0, j = xs.size()-1; k < xs.size(); j = k++)
+        area += (double) xs[j]*(-ys[k]) - (double) xs[k]*(-ys[j]);
+      
+      ring_x.push_back(xs);
+      ring_y.push_back(ys);
+      ring_area.push_back(area/2);
+      ring_cell.push_back(g.index(ry[0] + (rdr[0]-rdc[0]-1)/2, rx[0] + (rdc[0]+rdr[0]-1)/2));
+    }
+    
+    // Parts of the label are numbered in the order of their outer rings, holes take the part of the cell on their left
+    vector<int> ring_part(ring_x.size(), 0);
+    int parts = 0;
+    for(size_t k = 0; k < ring_x.size(); k++){
+      if(ring_area[k] > 0)
+        ring_part[k] = ++parts;
+    }
+    
+    if(parts < (int) ring_x.size()){
+      if(cell_part.empty())
+        number_parts();
+      unordered_map<int, int> part_of;
+      for(size_t k = 0; k < ring_x.size(); k++){
+        if(ring_area[k] > 0)
+          part_of[cell_part[ring_cell[k]]] = ring_part[k];
+      }
+      for(size_t k = 0; k < ring_x.size(); k++){
+        if(ring_area[k] < 0)
+          ring_part[k] = part_of[cell_part[ring_cell[k]]];
+      }
+    }
+    
+    for(int p = 1; p <= parts; p++){
+      for(int is_hole = 0; is_hole <= 1; is_hole++){
+        for(size_t k = 0; k < ring_x.size(); k++){
+          if(ring_part[k] != p || (ring_area[k] < 0) != (bool) is_hole)
+            continue;
+          for(size_t v = 0; v <= ring_x[k].size(); v++){
+            id.push_back(label_edges.first);
+            part.push_back(p);
+            hole.push_back(is_hole);
+            x.push_back(ring_x[k][v % ring_x[k].size()]);
+            y.push_back(ring_y[k][v % ring_y[k].size()]);
+          }
+        }
+      }
+    }
+  }
+  
+  return List::create(_["id"] = wrap(id), _["part"] = wrap(part), _["x"] = wrap(x), _["y"] = wrap(y), _["hole"] = wrap(hole));
+}
+
+// Raster of watershed labels, or with polygons the polygon rings of the watersheds
+template <typename F>
+static SEXP d8_watershed_output(const F* flowdirs, const grid& g, NumericMatrix target_rc, bool nested, bool polygons){
+  
+  if(polygons){
+    vector<int> scratch(g.size()); // Labels for tracing the rings, not returned
+    label_matrix watershed = {scratch.data()};
+    d8_watershed_expand(flowdirs, g, target_rc, nested, watershed);
+    return label_rings(g, scratch.data());
+  }
+  
+  IntegerMatrix watershed(g.nrow, g.ncol);
+  label_matrix labels = {watershed.begin()};
+  d8_watershed_expand(flowdirs, g, target_rc, nested, labels);
+  
+  return watershed;
+}
+
+template <int FTYPE>
+static SEXP d8_watershed_nested_t(Matrix<FTYPE> flowdirs, NumericMatrix target_rc, bool nested, bool polygons){
+  return d8_watershed_output(flowdirs.begin(), grid(flowdirs.nrow(), flowdirs.ncol()), target_rc, nested, polygons);
+}
+
+// Topology of the subbasins as a data frame
+static DataFrame subbasin_table(const std::map<int, subbasin>& subbasins){
+  
+  IntegerVector label(subbasins.size()), downstream(subbasins.size());
+  NumericVector local(subbasins.size()), cumulative(subbasins.size());
+  int k = 0;
+  
+  for(auto& s : subbasins){
+    label[k] = s.first;
+    downstream[k] = s.second.downstream == 0 ? NA_INTEGER : s.second.downstream;
+    local[k] = s.second.local;
+    cumulative[k] = s.second.cumulative;
+    k++;
+  }
+  
+  return DataFrame::create(_["label"] = label, _["downstream"] = downstream, _["local"] = local, _["cumulative"] = cumulative);
+}
+
+template <int FTYPE>
+static List d8_watershed_hierarchy_t(Matrix<FTYPE> flowdirs, NumericMatrix target_rc, bool polygons){
+
+  grid g(flowdirs.nrow(), flowdirs.ncol());
+  
+  if(polygons){
+    vector<int> scratch(g.size()); // Labels for tracing the rings, not returned
+    label_matrix watershed = {scratch.data()};
+    std::map<int, subbasin> subbasins = d8_watershed_hierarchy_expand(flowdirs.begin(), g, target_rc, watershed);
+    return List::create(_["watershed"] = label_rings(g, scratch.data()), _["topology"] = subbasin_table(subbasins));
+  }
+  
+  IntegerMatrix watershed(flowdirs.nrow(), flowdirs.ncol());
+  label_matrix labels = {watershed.begin()};
+  std::map<int, subbasin> subbasins = d8_watershed_hierarchy_expand(flowdirs.begin(), g, target_rc, labels);
+  
+  return List::create(_["watershed"] = watershed, _["topology"] = subbasin_table(subbasins));
+}
+
+//' Function for d8 watersheds to a target area identified by row-col indexes
+//' Potentially with labeling of nested watersheds
+//'
+//' With polygons = TRUE, the boundaries of the watersheds are traced from a scratch grid of labels, 
+//' so no raster of labels is returned.
+//'
+//' @param flowdirs The d8 pointer flow direction raster, an integer or raw matrix
+//' @param target_rc The outlet
+//' @param nested Boolean
+//' @param polygons Return the boundaries of the watersheds as polygon rings instead of a raster
+//' @return a watershed raster, or with polygons = TRUE a list with the vertices of the polygon rings (id as the watershed label, part, x and y as column and row of cell corners from the top left corner of the raster, and hole)
+// [[Rcpp::export]]
+SEXP d8_watershed_nested(SEXP flowdirs, NumericMatrix target_rc, bool nested, bool polygons = false){
+  switch(TYPEOF(flowdirs)){
+  case RAWSXP:
+    return d8_watershed_nested_t<RAWSXP>(flowdirs, target_rc, nested, polygons);
+  default:
+    return d8_watershed_nested_t<INTSXP>(flowdirs, target_rc, nested, polygons);
+  }
+}
+
+//' Function for the hierarchy of nested d8 watersheds of outlets identified by row-col indexes
+//'
+//' Each cell is labelled with its nearest outlet downstream in a single pass, including the outlets themselves, and the outlets are linked to the 
+//' nearest outlet downstream. Unlike d8_watershed_nested, where the first watershed expanded to a cell takes it, the labels follow the hierarchy of the outlets.
+//' An outlet may consist of several cells with the same label, and it is then linked to the first outlet found downstream of any of its cells.
+//'
+//' @param flowdirs The d8 pointer flow direction raster, an integer or raw matrix
+//' @param target_rc The outlets, as row, column and label
+//' @param polygons Return the boundaries of the watersheds as polygon rings instead of a raster
+//' @return List with the watershed raster (or polygon rings as in d8_watershed_nested) and a data frame with the topology of the outlets: label, label of the downstream outlet (NA if none), 
+//' number of cells draining to the outlet without passing another outlet (local) and number of cells draining to the outlet (cumulative)
+// [[Rcpp::export]]
+List d8_watershed_hierarchy(SEXP flowdirs, NumericMatrix target_rc, bool polygons = false){
+  switch(TYPEOF(flowdirs)){
+  case RAWSXP:
+    return d8_watershed_hierarchy_t<RAWSXP>(flowdirs, target_rc, polygons);
+  default:
+    return d8_watershed_hierarchy_t<INTSXP>(flowdirs, target_rc, polygons);
+  }
+}
+
+// Reverse flow index
+
+// Upstream graph of a d8 flow direction raster for repeated watershed queries.
+// The upstream neighbours of each cell are stored in compressed sparse row format (upstream[start[i]] to upstream[start[i+1]-1])
+// and cells are numbered in depth-first preorder from the outlets of the raster. The cells upstream of a cell, including 
+// itself, then have the preorder numbers pre to pre+size-1 and are stored consecutively in order.
+// Cells are indexed column-major, cells with nodata or not draining to an outlet have pre = -1.
+class flow_index{
+public:
+  int nrow;
+  int ncol;
+  vector<int> start;
+  vector<int> upstream;
+  vector<int> pre;
+  vector<int> size;
+  vector<int> order;
+  
+  template <typename F>
+  flow_index(const F* flowdirs, int nrow, int ncol): nrow(nrow), ncol(ncol){
+    
+    grid g(nrow, ncol);
+    int ncell = g.size();
+    vector<int> downstream(ncell, -1);
+    start.assign(ncell+1, 0);
+    
+    for(int c = 0; c < ncol; c++){
+      for(int r = 0; r < nrow; r++){
+        size_t i = g.index(r, c);
+        int n = flowdirs[i];
+        if(n == flowdir_nodata)
+          continue;
+        
+        if(!g.inside(r+dy[n], c+dx[n]))
+          continue;
+        
+        size_t ni = i + g.offset[n];
+        if(flowdirs[ni] == flowdir_nodata)
+          continue;
+        
+        downstream[i] = ni;
+        start[ni + 1]++;
+      }
+    }
+    
+    for(int i = 0; i < ncell; i++){
+      start[i+1] += start[i];
+    }
+    
+    upstream.resize(start[ncell]);
+    vector<int> fill_pos(start.begin(), start.end()-1);
+    for(int i = 0; i < ncell; i++){
+      if(downstream[i] != -1)
+        upstream[fill_pos[downstream[i]]++] = i;
+    }
+    
+    // Depth-first traversal from each outlet, the cells upstream of a cell are numbered before any of its siblings
+    pre.assign(ncell, -1);
+    size.assign(ncell, 0);
+    order.reserve(ncell);
+    vector<int> stack;
+    
+    for(int i = 0; i < ncell; i++){
+      if(flowdirs[i] == flowdir_nodata || downstream[i] != -1)
+        continue;
+      
+      stack.push_back(i);
+      while(stack.size()>0){
+        int j = stack.back();
+        stack.pop_back();
+        pre[j] = order.size();
+        order.push_back(j);
+        for(int k = start[j]; k < start[j+1]; k++){
+          stack.push_back(upstream[k]);
+        }
+      }
+    }
+    
+    // Visiting cells upstream before downstream, each cell adds its subtree to its downstream cell
+    for(int k = order.size()-1; k >= 0; k--){
+      int i = order[k];
+      size[i]++;
+      if(downstream[i] != -1)
+        size[downstream[i]] += size[i];
+    }
+  }
+  
+  // Column-major index of a terra cell number (row-major, starting at 1)
+  int cell_index(int cell) const {
+    if(cell == NA_INTEGER || cell < 1 || cell > nrow*ncol)
+      stop("Cell numbers must be between 1 and the number of cells in the raster");
+    int r = (cell-1) / ncol;
+    int c = (cell-1) % ncol;
+    return c*nrow + r;
+  }
+  
+  // terra cell number of a column-major index
+  int cell_number(int i) const {
+    return (i % nrow)*ncol + i / nrow + 1;
+  }
+  
+  // Is cell a upstream of (or equal to) cell b
+  bool is_upstream(int a, int b) const {
+    return pre[b] != -1 && pre[b] <= pre[a] && pre[a] < pre[b] + size[b];
+  }
+};
+
+//' Reverse flow index of a d8 flow direction raster
+//'
+//' The index holds the upstream graph of the raster with cells numbered in depth-first order from the outlets, 
+//' so that the cells upstream of any cell can be listed in time proportional to their number.
+//'
+//' @param flowdirs The d8 pointer flow direction raster, an integer or raw matrix
+//' @return External pointer to the index
+// [[Rcpp::export]]
+SEXP d8_flow_index(SEXP flowdirs){
+  
+  if(TYPEOF(flowdirs) == RAWSXP){
+    RawMatrix raw_flowdirs(flowdirs);
+    return XPtr<flow_index>(new flow_index(raw_flowdirs.begin(), raw_flowdirs.nrow(), raw_flowdirs.ncol()), true);
+  }
+  
+  IntegerMatrix int_flowdirs(flowdirs);
+  return XPtr<flow_index>(new flow_index(int_flowdirs.begin(), int_flowdirs.nrow(), int_flowdirs.ncol()), true);
+}
+
+// Queries of a reverse flow index, shared by the index and the flow model
+static List index_upstream_cells(const flow_index& fi, IntegerVector cells){
+  
+  List result(cells.size());
+  
+  for(int k = 0; k < cells.size(); k++){
+    int i = fi.cell_index(cells[k]);
+    if(fi.pre[i] == -1){
+      result[k] = IntegerVector(0);
+      continue;
+    }
+    
+    IntegerVector upstream_cells(fi.size[i]);
+    for(int j = 0; j < fi.size[i]; j++){
+      upstream_cells[j] = fi.cell_number(fi.order[fi.pre[i] + j]);
+    }
+    result[k] = upstream_cells;
+  }
+  
+  return result;
+}
+
+static IntegerVector index_upstream_count(const flow_index& fi, IntegerVector cells){
+  
+  IntegerVector count(cells.size());
+  
+  for(int k = 0; k < cells.size(); k++){
+    count[k] = fi.size[fi.cell_index(cells[k])];
+  }
+  
+  return count;
+}
+
+static LogicalVector index_is_upstream(const flow_index& fi, IntegerVector from, IntegerVector to){
+  
+  if(from.size() != to.size())
+    stop("from and to must have the same length");
+  
+  LogicalVector result(from.size());
+  
+  for(int k = 0; k < from.size(); k++){
+    result[k] = fi.is_upstream(fi.cell_index(from[k]), fi.cell_index(to[k]));
+  }
+  
+  return result;
+}
+
+//' Cells upstream of outlets from a reverse flow index
+//'
+//' @param index External pointer from d8_flow_index
+//' @param cells Outlet cell numbers (row-major, starting at 1 as in terra)
+//' @return List with the numbers of the cells upstream of each outlet, including the outlet, in depth-first order
+// [[Rcpp::export]]
+List d8_index_upstream_cells(SEXP index, IntegerVector cells){
+  XPtr<flow_index> ptr(index);
+  return index_upstream_cells(*ptr.checked_get(), cells);
+}
+
+//' Number of cells upstream of outlets from a reverse flow index
+//'
+//' @param index External pointer from d8_flow_index
+//' @param cells Outlet cell numbers (row-major, starting at 1 as in terra)
+//' @return Number of cells upstream of each outlet, including the outlet
+// [[Rcpp::export]]
+IntegerVector d8_index_upstream_count(SEXP index, IntegerVector cells){
+  XPtr<flow_index> ptr(index);
+  return index_upstream_count(*ptr.checked_get(), cells);
+}
+
+//' Test whether cells are upstream of other cells from a reverse flow index
+//'
+//' @param index External pointer from d8_flow_index
+//' @param from Cell numbers (row-major, starting at 1 as in terra)
+//' @param to Cell numbers of the same length as from
+//' @return TRUE where from drains to (or is) to
+// [[Rcpp::export]]
+LogicalVector d8_index_is_upstream(SEXP index, IntegerVector from, IntegerVector to){
+  XPtr<flow_index> ptr(index);
+  return index_is_upstream(*ptr.checked_get(), from, to);
+}
+
+// Incremental updates
+
+// Flow direction of a single cell, as d8_flowdir_column
+template <typename T>
+static int d8_flowdir_cell(const T* dem, const grid& g, size_t i){
+  
+  int r = g.row(i), c = g.col(i);
+  
+  if(is_nodata(dem[i]))
+    return flowdir_nodata;
+  
+  if(g.edge(r, c))
+    return d8_edge_flowdir(r, c, g.nrow, g.ncol);
+  
+  T minimum_elevation = dem[i];
+  int fd = 0;
+  
+  for(int n = 1; n <= 8; n++){
+    T e = elevation(dem[i + g.offset[n]]);
+    if(e < minimum_elevation || (n%2 == 1 && e == minimum_elevation && fd > 0 && fd%2 == 0)){
+      minimum_elevation = e;
+      fd = n;
+    }
+  }
+  
+  return fd;
+}
+
+// Cell receiving the flow of cell i with flow direction n, or -1 if flow leaves the grid, ends in nodata or i has no flow direction
+template <typename F>
+static long d8_receiver(const grid& g, size_t i, int n, const F* flowdirs){
+  
+  if(n == flowdir_nodata || !g.inside(g.row(i)+dy[n], g.col(i)+dx[n]))
+    return -1;
+  
+  size_t ni = i + g.offset[n];
+  
+  return flowdirs[ni] == flowdir_nodata ? -1 : (long) ni;
+}
+
+// Incremental update of a filled DEM (pf_eps_barnes2014), its d8 flow directions and flow accumulation (d8_flow_accum) 
+// after the DEM has been changed at some cells. Only the cells affected by the change are visited:
+// 1. Changed cells raised above the filled surface are raised, and the cells draining through them are raised upstream 
+//    until they are above the level reaching them. The raised surface drains, but not always at the lowest level.
+// 2. Cells which can drain at a lower level through the changed cells or around the raised cells are lowered in a wave from the lowest cell up.
+// 3. Flow directions are determined again next to cells with a changed filled elevation.
+// 4. Flow accumulation is determined again along the old and new downstream paths of cells with changed flow directions.
+// The result is a valid epsilon-filled surface, but the epsilon increments can differ from filling the whole DEM again.
+static List d8_update_cells(NumericMatrix dem, NumericMatrix filled, IntegerMatrix flowdirs, NumericMatrix area, 
+                      const vector<size_t>& cells, const vector<double>& values){
+  
+  typedef priority_queue<cellz<double>, vector<cellz<double>>, greater<cellz<double>>> open_queue;
+  
+  grid g(dem.nrow(), dem.ncol());
+  double eps_inf = numeric_limits<double>::infinity();
+  unordered_map<size_t, double> old_filled;
+  
+  auto source_elevation = [&](size_t i){ return elevation(filled[i]); };
+  auto set_filled = [&](size_t i, double z){
+    if(z != filled[i]){
+      old_filled.emplace(i, filled[i]);
+      filled[i] = z;
+    }
+  };
+  
+  for(size_t k = 0; k < cells.size(); k++){
+    if(is_nodata(values[k]) != is_nodata(dem[cells[k]]))
+      stop("Cells can not be changed to or from nodata");
+  }
+  
+  // Step 1, raised cells and the cells draining through them, raised upstream while they are below the level reaching them
+  open_queue open;
+  
+  for(size_t k = 0; k < cells.size(); k++){
+    size_t i = cells[k];
+    dem[i] = values[k];
+    
+    if(is_nodata(dem[i]) || dem[i] <= filled[i])
+      continue;
+    
+    set_filled(i, dem[i]);
+    open.push(cellz<double>(g.row(i), g.col(i), filled[i]));
+  }
+  
+  while(open.size()>0){
+    cellz<double> c = open.top();
+    open.pop();
+    
+    size_t i = g.index(c.r, c.c);
+    
+    if(c.z != filled[i])
+      continue;
+    
+    for(int n = 1; n <= 8; n++){
+      int nr = c.r+dy[n], nc = c.c+dx[n];
+      if(!g.inside(nr, nc))
+        continue;
+      
+      size_t ni = i + g.offset[n];
+      if(d8_receiver(g, ni, flowdirs[ni], flowdirs.begin()) != (long) i)
+        continue;
+      
+      double z = max(dem[ni], nextafter(c.z, eps_inf));
+      if(z > filled[ni]){
+        set_filled(ni, z);
+        open.push(cellz<double>(nr, nc, z));
+      }
+    }
+  }
+  
+  // Step 2, lowering from the changed cells and around the raised cells, the raised cells can drain at a lower level elsewhere
+  vector<size_t> seeds(cells);
+  for(auto& changed : old_filled)
+    seeds.push_back(changed.first);
+  
+  for(size_t k = 0; k < seeds.size(); k++){
+    size_t i = seeds[k];
+    int r = g.row(i), c = g.col(i);
+    
+    if(is_nodata(dem[i]))
+      continue;
+    
+    if(k < cells.size() && g.edge(r, c))
+      set_filled(i, dem[i]);
+    
+    for(int n = 0; n <= 8; n++){
+      if(g.inside(r+dy[n], c+dx[n]))
+        open.push(cellz<double>(r+dy[n], c+dx[n], source_elevation(i + g.offset[n])));
+    }
+  }
+  
+  while(open.size()>0){
+    cellz<double> c = open.top();
+    open.pop();
+    
+    size_t i = g.index(c.r, c.c);
+    
+    if(c.z > source_elevation(i))
+      continue;
+    
+    for(int n = 1; n <= 8; n++){
+      int nr = c.r+dy[n], nc = c.c+dx[n];
+      if(!g.inside(nr, nc))
+        continue;
+      
+      size_t ni = i + g.offset[n];
+      if(is_nodata(dem[ni]))
+        continue;
+      
+      double z = max(dem[ni], nextafter(c.z, eps_inf));
+      if(z < filled[ni]){
+        set_filled(ni, z);
+        open.push(cellz<double>(nr, nc, z));
+      }
+    }
+  }
+  
+  // Step 3, flow directions next to changed cells (cells raised in step 1 can be lowered to their old elevation in step 2)
+  unordered_map<size_t, int> old_flowdirs;
+  int n_filled = 0;
+  
+  for(auto& changed : old_filled){
+    size_t i = changed.first;
+    if(filled[i] == changed.second)
+      continue;
+    
+    ++n_filled;
+    int r = g.row(i), c = g.col(i);
+    for(int n = 0; n <= 8; n++){
+      if(!g.inside(r+dy[n], c+dx[n]))
+        continue;
+      size_t ni = i + g.offset[n];
+      int fd = d8_flowdir_cell(filled.begin(), g, ni);
+      if(fd != flowdirs[ni]){
+        old_flowdirs.emplace(ni, flowdirs[ni]);
+        flowdirs[ni] = fd;
+      }
+    }
+  }
+  
+  // Step 4, flow accumulation along the old and new downstream paths
+  auto old_receiver = [&](size_t i) -> long {
+    auto it = old_flowdirs.find(i);
+    int n = it == old_flowdirs.end() ? flowdirs[i] : it->second;
+    if(n == flowdir_nodata || !g.inside(g.row(i)+dy[n], g.col(i)+dx[n]))
+      return -1;
+    size_t ni = i + g.offset[n];
+    auto nit = old_flowdirs.find(ni);
+    return (nit == old_flowdirs.end() ? flowdirs[ni] : nit->second) == flowdir_nodata ? -1 : (long) ni;
+  };
+  auto new_receiver = [&](size_t i){ return d8_receiver(g, i, flowdirs[i], flowdirs.begin()); };
+  
+  unordered_map<size_t, int> dependency; // Cells on the paths, with their number of upstream cells on the paths
+  unordered_map<size_t, bool> old_path, new_path;
+  
+  for(auto& changed : old_flowdirs){
+    for(long i = changed.first; i != -1 && !old_path.count(i); i = old_receiver(i)){
+      old_path[i] = true;
+      dependency[i] = 0;
+    }
+    for(long i = changed.first; i != -1 && !new_path.count(i); i = new_receiver(i)){
+      new_path[i] = true;
+      dependency[i] = 0;
+    }
+  }
+  
+  for(auto& d : dependency){
+    long ni = new_receiver(d.first);
+    if(ni != -1 && dependency.count(ni))
+      ++dependency[ni];
+  }
+  
+  std::queue<size_t> sources;
+  for(auto& d : dependency){
+    if(d.second == 0)
+      sources.push(d.first);
+  }
+  
+  while(sources.size()>0){
+    size_t i = sources.front();
+    sources.pop();
+    
+    if(flowdirs[i] == flowdir_nodata){
+      area[i] = -1;
+      continue;
+    }
+    
+    area[i] = 1;
+    for(int n = 1; n <= 8; n++){
+      if(!g.inside(g.row(i)+dy[n], g.col(i)+dx[n]))
+        continue;
+      size_t ni = i + g.offset[n];
+      if(new_receiver(ni) == (long) i)
+        area[i] += area[ni];
+    }
+    
+    long ni = new_receiver(i);
+    if(ni != -1 && dependency.count(ni) && --dependency[ni] == 0)
+      sources.push(ni);
+  }
+  
+  return List::create(_["filled"] = n_filled, _["flowdirs"] = (int) old_flowdirs.size(), 
+                      _["accum"] = (int) dependency.size());
+}
+
+//' Incremental update of a filled DEM, d8 flow directions and flow accumulation after changes to the DEM
+//'
+//' The filled DEM, flow directions and flow accumulation are updated in place. Only the cells below the new level upstream of raised cells, 
+//' the cells lowered, their neighbours and the downstream paths of cells with changed flow directions are visited. The time is 
+//' O(m log m) for m such cells, and the downstream paths can reach the edge of the DEM.
+//'
+//' @param dem The digital elevation model (DEM), changed in place
+//' @param filled The DEM filled with pf_eps_barnes2014
+//' @param flowdirs The d8 flow directions of filled from d8_flow_directions
+//' @param area The flow accumulation of flowdirs from d8_flow_accum
+//' @param cells Numbers of the changed cells (row-major, starting at 1 as in terra)
+//' @param values New elevations of the changed cells, nodata cells can not be changed
+//' @return List with the number of cells with a changed filled elevation (filled) and flow direction (flowdirs), and the number of cells where flow accumulation was determined again (accum)
+// [[Rcpp::export]]
+List d8_update(NumericMatrix dem, NumericMatrix filled, IntegerMatrix flowdirs, NumericMatrix area, IntegerVector cells, NumericVector values){
+  
+  grid g(dem.nrow(), dem.ncol());
+  
+  if(filled.nrow() != g.nrow || filled.ncol() != g.ncol || flowdirs.nrow() != g.nrow || flowdirs.ncol() != g.ncol || 
+     area.nrow() != g.nrow || area.ncol() != g.ncol)
+    stop("dem, filled, flowdirs and area must have the same dimensions");
+  
+  if(cells.size() != values.size())
+    stop("cells and values must have the same length");
+  
+  vector<size_t> cell_index(cells.size());
+  for(int k = 0; k < cells.size(); k++){
+    if(cells[k] == NA_INTEGER || cells[k] < 1 || (size_t) cells[k] > g.size())
+      stop("Cell numbers must be between 1 and the number of cells in the raster");
+    cell_index[k] = g.index((cells[k]-1) / g.ncol, (cells[k]-1) % g.ncol);
+  }
+  
+  return d8_update_cells(dem, filled, flowdirs, area, cell_index, vector<double>(values.begin(), values.end()));
+}
+
+// Stream networks
+
+// Stream cell in the traversal of a stream network
+struct stream_cell {
+  int inflows = 0;   // Number of upstream stream cells
+  int remaining = 0; // Upstream stream cells not yet visited
+  int segment = -1;
+  int max_order = 0; // Highest Strahler order of the segments ending here, and the number of segments with that order
+  int max_count = 0;
+  int magnitude = 0; // Sum of the Shreve magnitudes of the segments ending here
+};
+
+// Segment of a stream network, running from a source or junction (head) to the cell before the next junction or an outlet (tail)
+struct stream_segment {
+  size_t head;
+  size_t tail;
+  long downstream_cell = -1;
+  int strahler;
+  int shreve;
+};
+
+// Stream network of the cells with a flow accumulation of at least threshold.
+// Stream cells are visited in topological order from the sources (as in d8_flow_accum), so segments are numbered from upstream 
+// to downstream and the order of a segment is known when its head is visited. Only stream cells are stored, no full size grids.
+template <typename F>
+static List d8_stream_network_q(const F* fd, const double* area, const grid& g, double threshold, double xres, double yres){
+  
+  unordered_map<size_t, stream_cell> cells;
+  
+  auto receiver = [&](size_t i) -> long {
+    long ni = d8_receiver(g, i, fd[i], fd);
+    return ni != -1 && area[ni] >= threshold ? ni : -1;
+  };
+  
+  // Stream cells in storage order, so segments are numbered the same regardless of the order of the hash map
+  vector<size_t> stream_cells;
+  for(size_t i = 0; i < g.size(); i++){
+    if(fd[i] != flowdir_nodata && area[i] >= threshold){
+      cells[i];
+      stream_cells.push_back(i);
+    }
+  }
+  
+  for(size_t i : stream_cells){
+    long ni = receiver(i);
+    if(ni != -1){
+      cells[ni].inflows++;
+      cells[ni].remaining++;
+    }
+  }
+  
+  std::queue<size_t> sources;
+  for(size_t i : stream_cells){
+    if(cells[i].inflows == 0)
+      sources.push(i);
+  }
+  
+  vector<stream_segment> segments;
+  
+  while(sources.size()>0){
+    size_t i = sources.front();
+    sources.pop();
+    
+    stream_cell& s = cells[i];
+    
+    if(s.inflows != 1){
+      stream_segment seg;
+      seg.head = i;
+      seg.strahler = s.inflows == 0 ? 1 : s.max_order + (s.max_count > 1);
+      seg.shreve = s.inflows == 0 ? 1 : s.magnitude;
+      s.segment = segments.size();
+      segments.push_back(seg);
+    }
+    
+    stream_segment& seg = segments[s.segment];
+    seg.tail = i;
+    
+    long ni = receiver(i);
+    if(ni == -1)
+      continue;
+    
+    stream_cell& d = cells[ni];
+    
+    if(d.inflows == 1){
+      d.segment = s.segment;
+    } else {
+      seg.downstream_cell = ni;
+      if(seg.strahler > d.max_order){
+        d.max_order = seg.strahler;
+        d.max_count = 1;
+      } else if(seg.strahler == d.max_order){
+        d.max_count++;
+      }
+      d.magnitude += seg.shreve;
+    }
+    
+    if(--d.remaining == 0)
+      sources.push(ni);
+  }
+  
+  // Cell runs of the segments, from head to tail
+  int nseg = segments.size();
+  IntegerVector id(nseg), downstream(nseg), from_node(nseg), to_node(nseg), strahler(nseg), shreve(nseg), ncells(nseg);
+  NumericVector length(nseg);
+  vector<int> run;
+  auto cell_number = [&](size_t i){ return g.row(i)*g.ncol + g.col(i) + 1; };
+  
+  for(int k = 0; k < nseg; k++){
+    const stream_segment& seg = segments[k];
+    size_t start = run.size();
+    double seg_length = 0;
+    
+    for(size_t i = seg.head; ; ){
+      run.push_back(cell_number(i));
+      long ni = receiver(i);
+      if(ni != -1)
+        seg_length += sqrt(pow(dx[fd[i]]*xres, 2) + pow(dy[fd[i]]*yres, 2));
+      if(i == seg.tail)
+        break;
+      i = ni;
+    }
+    
+    id[k] = k+1;
+    downstream[k] = seg.downstream_cell == -1 ? NA_INTEGER : cells[seg.downstream_cell].segment+1;
+    from_node[k] = cell_number(seg.head);
+    to_node[k] = cell_number(seg.downstream_cell == -1 ? seg.tail : seg.downstream_cell);
+    strahler[k] = seg.strahler;
+    shreve[k] = seg.shreve;
+    length[k] = seg_length;
+    ncells[k] = run.size() - start;
+  }
+  
+  DataFrame table = DataFrame::create(_["id"] = id, _["downstream"] = downstream, _["from_node"] = from_node, _["to_node"] = to_node, 
+                                      _["strahler"] = strahler, _["shreve"] = shreve, _["length"] = length, _["ncells"] = ncells);
+  
+  return List::create(_["segments"] = table, _["cells"] = wrap(run));
+}
+
+template <int FTYPE>
+static List d8_stream_network_t(Matrix<FTYPE> flowdirs, NumericMatrix area, double threshold, double xres, double yres){
+  
+  if(area.nrow() != flowdirs.nrow() || area.ncol() != flowdirs.ncol())
+    stop("flowdirs and area must have the same dimensions");
+  
+  return d8_stream_network_q(flowdirs.begin(), area.begin(), grid(flowdirs.nrow(), flowdirs.ncol()), threshold, xres, yres);
+}
+
+//' Stream network from d8 flow directions and flow accumulation
+//'
+//' Streams are the cells with a flow accumulation of at least threshold. The network is split into segments at junctions, 
+//' and each segment is given the Strahler order and Shreve magnitude. 
+//'
+//' @param flowdirs The d8 pointer flow direction raster, an integer or raw matrix
+//' @param area The flow accumulation raster from d8_flow_accum
+//' @param threshold Lowest flow accumulation of stream cells
+//' @param xres Width of cells, used for segment lengths
+//' @param yres Height of cells, used for segment lengths
+//' @return List with a data frame of segments (id, downstream segment, from_node and to_node as cell numbers, strahler, shreve, length and ncells) and the cell numbers (row-major, starting at 1 as in terra) of the segments from head to tail, concatenated in order of id
+// [[Rcpp::export]]
+List d8_stream_network(SEXP flowdirs, NumericMatrix area, double threshold, double xres = 1, double yres = 1){
+  switch(TYPEOF(flowdirs)){
+  case RAWSXP:
+    return d8_stream_network_t<RAWSXP>(flowdirs, area, threshold, xres, yres);
+  default:
+    return d8_stream_network_t<INTSXP>(flowdirs, area, threshold, xres, yres);
+  }
+}
+
+// Batch processing
+
+// Steps of a batch pipeline
+enum batch_step { step_fill, step_fill_eps, step_breach, step_dirs, step_accum };
+
+// One DEM of a batch, with its outputs allocated on the main thread before the workers start
+struct batch_tile {
+  int nrow;
+  int ncol;
+  int* dem_int;
+  double* dem_double;
+  int* flowdirs;
+  double* area;
+  size_t false_pit_cells;
+};
+
+// Runs the steps of the pipeline on one DEM, minimum_elevation and dependency are scratch space of the thread
+template <typename T>
+static void batch_run(T* dem, batch_tile& t, const vector<int>& steps, vector<T>& minimum_elevation, vector<unsigned char>& dependency){
+  
+  grid g(t.nrow, t.ncol);
+  matrix_view<T> z(dem, t.nrow, t.ncol);
+  kernel_stats st(false);
+  
+  for(int step : steps){
+    switch(step){
+    case step_fill:
+      pf_barnes2014_q<T, heap_queue>(z, st);
+      break;
+    case step_fill_eps:
+      // Epsilon filling needs double precision, integer DEMs are rejected before the workers start
+      if constexpr (std::is_same<T, double>::value){
+        pf_eps_barnes2014_q(z, st);
+        t.false_pit_cells = st.false_pit_cells;
+      }
+      break;
+    case step_breach:
+      comp_breach_lindsay2016_q<T, heap_queue, memory_scratch>(z, st, "", breach_limits());
+      break;
+    case step_dirs:
+      minimum_elevation.resize(g.nrow);
+      for(int c = 0; c < g.ncol; c++)
+        d8_flowdir_column(dem, g, c, t.flowdirs + g.index(0, c), minimum_elevation.data());
+      break;
+    case step_accum:
+      d8_flow_accum_q(t.flowdirs, g, t.area, dependency);
+      break;
+    }
+  }
+}
+
+// Worker processing the DEMs of a range of the batch, the scheduler hands out ranges so threads finishing early take 
+// over remaining DEMs. Scratch buffers are kept for all DEMs of the range.
+struct batch_worker : public RcppParallel::Worker {
+  
+  vector<batch_tile>& tiles;
+  const vector<int>& steps;
+  
+  batch_worker(vector<batch_tile>& tiles, const vector<int>& steps): tiles(tiles), steps(steps){}
+  
+  void operator()(size_t begin, size_t end){
+    vector<int> minimum_elevation_int;
+    vector<double> minimum_elevation_double;
+    vector<unsigned char> dependency;
+    
+    for(size_t k = begin; k < end; k++){
+      batch_tile& t = tiles[k];
+      if(t.dem_int != nullptr)
+        batch_run(t.dem_int, t, steps, minimum_elevation_int, dependency);
+      else
+        batch_run(t.dem_double, t, steps, minimum_elevation_double, dependency);
+    }
+  }
+};
+
+//' Pipeline of kernels run on a batch of DEMs in parallel
+//'
+//' The DEMs are processed concurrently, one DEM per thread at a time, with the steps run in order on each DEM. 
+//' All outputs are allocated before the threads start.
+//'
+//' @param dems List of DEMs, integer or double matrices
+//' @param steps Kernels run on each DEM in order: one of 'fill' (pf_barnes2014), 'fill_eps' (pf_eps_barnes2014, double DEMs only) and 'breach' (comp_breach_lindsay2016) or 'breach' followed by 'fill_eps', then 'dirs' (d8_flow_directions) and 'accum' (d8_flow_accum)
+//' @param threads Number of threads
+//' @return List with a list for each DEM holding the outputs of the steps: the DEM with depressions removed (dem), flow directions (dirs) and flow accumulation (accum), NULL where no step gives the output
+// [[Rcpp::export]]
+List batch_pipeline(List dems, std::vector<std::string> steps, int threads = 1){
+  
+  vector<int> step_codes;
+  bool dem_steps = false, dirs = false, accum = false, eps = false;
+  
+  for(const string& step : steps){
+    if(step == "fill" || step == "fill_eps" || step == "breach"){
+      if(dirs)
+        stop("Depression steps must come before 'dirs'");
+      // Breached DEMs keep flats along the breach channels, which 'fill_eps' gives a gradient
+      bool breach_eps = step == "fill_eps" && step_codes.size() == 1 && step_codes[0] == step_breach;
+      if(dem_steps && !breach_eps)
+        stop("Only one of 'fill', 'fill_eps' and 'breach' can be used, or 'breach' followed by 'fill_eps'");
+      step_codes.push_back(step == "fill" ? step_fill : step == "fill_eps" ? step_fill_eps : step_breach);
+      dem_steps = true;
+      eps = eps || step == "fill_eps";
+    } else if(step == "dirs" && !dirs){
+      step_codes.push_back(step_dirs);
+      dirs = true;
+    } else if(step == "accum" && dirs && !accum){
+      step_codes.push_back(step_accum);
+      accum = true;
+    } else {
+      stop("Steps must be 'fill', 'fill_eps' or 'breach', followed by 'dirs' and 'accum' once each");
+    }
+  }
+  
+  vector<batch_tile> tiles(dems.size());
+  List result(dems.size());
+  
+  for(int k = 0; k < dems.size(); k++){
+    SEXP dem = dems[k];
+    batch_tile& t = tiles[k];
+    SEXP dem_out = R_NilValue, dirs_out = R_NilValue, accum_out = R_NilValue;
+    
+    if(!Rf_isMatrix(dem) || (TYPEOF(dem) != INTSXP && TYPEOF(dem) != REALSXP))
+      stop("dems must be integer or double matrices");
+    if(eps && TYPEOF(dem) != REALSXP)
+      stop("fill_eps needs double DEMs");
+    
+    t.nrow = Rf_nrows(dem);
+    t.ncol = Rf_ncols(dem);
+    t.dem_int = nullptr;
+    t.dem_double = nullptr;
+    t.false_pit_cells = 0;
+    
+    if(TYPEOF(dem) == INTSXP){
+      IntegerMatrix m = dem_steps ? clone(IntegerMatrix(dem)) : IntegerMatrix(dem);
+      t.dem_int = m.begin();
+      if(dem_steps)
+        dem_out = m;
+    } else {
+      NumericMatrix m = dem_steps ? clone(NumericMatrix(dem)) : NumericMatrix(dem);
+      t.dem_double = m.begin();
+      if(dem_steps)
+        dem_out = m;
+    }
+    
+    if(dirs){
+      IntegerMatrix flowdirs(t.nrow, t.ncol);
+      t.flowdirs = flowdirs.begin();
+      dirs_out = flowdirs;
+    }
+    
+    if(accum){
+      NumericMatrix area(t.nrow, t.ncol);
+      t.area = area.begin();
+      accum_out = area;
+    }
+    
+    result[k] = List::create(_["dem"] = dem_out, _["dirs"] = dirs_out, _["accum"] = accum_out);
+  }
+  
+  batch_worker worker(tiles, step_codes);
+  RcppParallel::parallelFor(0, tiles.size(), worker, 1, max(1, threads));
+  
+  size_t false_pit_cells = 0;
+  for(const batch_tile& t : tiles)
+    false_pit_cells += t.false_pit_cells;
+  
+  if(false_pit_cells){
+    Rcout<<"Warning: While raising elevation of depression cells. Elevation for " <<false_pit_cells<< "  cells were increased above that of surrounding cells." << std::endl;
+  }
+  
+  return result;
+}
+
+// Flow model
+
+// Conditioned DEM, d8 flow directions, flow accumulation and reverse flow index of a DEM, kept in memory between queries.
+// The flow directions are kept with one byte per cell. Queries use the rasters of the model directly, so only their results 
+// are converted to R objects.
+class flow_model{
+public:
+  grid g;
+  vector<double> dem;
+  vector<unsigned char> flowdirs;
+  vector<double> area;
+  flow_index index;
+  
+  flow_model(const grid& g, vector<double>&& dem, vector<unsigned char>&& flowdirs): 
+    g(g), dem(std::move(dem)), flowdirs(std::move(flowdirs)), area(g.size()), index(this->flowdirs.data(), g.nrow, g.ncol){
+    
+    vector<unsigned char> dependency;
+    d8_flow_accum_q(this->flowdirs.data(), g, area.data(), dependency);
+  }
+};
+
+static const flow_model& model_of(SEXP model){
+  XPtr<flow_model> ptr(model);
+  return *ptr.checked_get();
+}
+
+//' Flow model of a DEM for repeated queries
+//'
+//' Depressions are removed from the DEM, and d8 flow directions (as d8_flow_directions, with flats resolved unless condition is 'fill_eps'), 
+//' flow accumulation (as d8_flow_accum) and a reverse flow index (as d8_flow_index) are determined once and kept in memory.
+//'
+//' @param dem The input digital elevation model (DEM), a double matrix
+//' @param condition Removal of depressions: 'fill_eps' (pf_eps_barnes2014, default), 'fill' (pf_barnes2014), 'breach' (comp_breach_lindsay2016) or 'none'
+//' @return External pointer to the model
+// [[Rcpp::export]]
+SEXP d8_model_build(NumericMatrix dem, std::string condition = "fill_eps"){
+  
+  grid g(dem.nrow(), dem.ncol());
+  vector<double> z(dem.begin(), dem.end());
+  matrix_view<double> view(z.data(), g.nrow, g.ncol);
+  kernel_stats st(false);
+  
+  if(condition == "fill_eps")
+    pf_eps_barnes2014_q(view, st);
+  else if(condition == "fill")
+    pf_barnes2014_q<double, heap_queue>(view, st);
+  else if(condition == "breach")
+    comp_breach_lindsay2016_q<double, heap_queue, memory_scratch>(view, st, "", breach_limits());
+  else if(condition != "none")
+    stop("condition must be 'fill_eps', 'fill', 'breach' or 'none'");
+  
+  if(st.false_pit_cells){
+    Rcout<<"Warning: While raising elevation of depression cells. Elevation for " <<st.false_pit_cells<< "  cells were increased above that of surrounding cells." << std::endl;
+  }
+  
+  vector<unsigned char> flowdirs(g.size());
+  vector<double> minimum_elevation(g.nrow);
+  for(int c = 0; c < g.ncol; c++)
+    d8_flowdir_column(z.data(), g, c, flowdirs.data() + g.index(0, c), minimum_elevation.data());
+  
+  // Filling and breaching without epsilon leave flats, which would end every query of the model
+  if(condition != "fill_eps")
+    d8_resolve_flats(z.data(), g, flowdirs.data());
+  
+  return XPtr<flow_model>(new flow_model(g, std::move(z), std::move(flowdirs)), true);
+}
+
+//' Rasters of a flow model
+//'
+//' @param model External pointer from d8_model_build
+//' @param layer 'dem' (the DEM with depressions removed), 'dirs' (d8 flow directions, 0 for nodata) or 'accum' (flow accumulation, -1 for nodata)
+//' @return The layer as a double matrix, or an integer matrix for 'dirs'
+// [[Rcpp::export]]
+SEXP d8_model_layer(SEXP model, std::string layer){
+  
+  const flow_model& m = model_of(model);
+  
+  if(layer == "dirs"){
+    IntegerMatrix flowdirs(m.g.nrow, m.g.ncol);
+    std::copy(m.flowdirs.begin(), m.flowdirs.end(), flowdirs.begin());
+    return flowdirs;
+  }
+  
+  if(layer != "dem" && layer != "accum")
+    stop("layer must be 'dem', 'dirs' or 'accum'");
+  
+  const vector<double>& values = layer == "dem" ? m.dem : m.area;
+  NumericMatrix result(m.g.nrow, m.g.ncol);
+  std::copy(values.begin(), values.end(), result.begin());
+  
+  return result;
+}
+
+//' Flow accumulation of cells from a flow model
+//'
+//' @param model External pointer from d8_model_build
+//' @param cells Cell numbers (row-major, starting at 1 as in terra)
+//' @return Flow accumulation of the cells, NA for nodata
+// [[Rcpp::export]]
+NumericVector d8_model_accum(SEXP model, IntegerVector cells){
+  
+  const flow_model& m = model_of(model);
+  
+  NumericVector area(cells.size());
+  
+  for(int k = 0; k < cells.size(); k++){
+    int i = m.index.cell_index(cells[k]);
+    area[k] = m.flowdirs[i] == flowdir_nodata ? NA_REAL : m.area[i];
+  }
+  
+  return area;
+}
+
+//' Weighted flow accumulation of several layers from a flow model
+//'
+//' As d8_weighted_flow_accum, but cells are visited from upstream to downstream in the reverse depth-first order of the 
+//' reverse flow index of the model, so the dependencies of the cells are not determined again.
+//'
+//' @param model External pointer from d8_model_build
+//' @param weights Weights as a matrix, or an array with one slice per layer, with the rows and columns of the model
+//' @return an array of weighted flow accumulation with the dimensions of weights, NA for nodata
+// [[Rcpp::export]]
+NumericVector d8_model_weighted_accum(SEXP model, NumericVector weights){
+  
+  const flow_model& m = model_of(model);
+  const grid& g = m.g;
+  const unsigned char* fd = m.flowdirs.data();
+  
+  size_t K = weight_layers(weights, g);
+  
+  vector<double> acc(g.size()*K);
+  for(size_t k = 0; k<K; k++){
+    const double* w = weights.begin() + k*g.size();
+    for(size_t i = 0; i<g.size(); i++)
+      acc[i*K + k] = w[i];
+  }
+  
+  // Cells upstream of a cell come after it in depth-first order
+  for(size_t o = m.index.order.size(); o-- > 0; ){
+    size_t i = m.index.order[o];
+    long ni = d8_receiver(g, i, fd[i], fd);
+    
+    if(ni == -1)
+      continue;
+    
+    const double* from = &acc[i*K];
+    double* to = &acc[ni*K];
+    for(size_t k = 0; k<K; k++)
+      to[k] += from[k];
+  }
+  
+  NumericVector result(weights.size());
+  result.attr("dim") = weights.attr("dim");
+  
+  for(size_t k = 0; k<K; k++){
+    double* out = result.begin() + k*g.size();
+    for(size_t i = 0; i<g.size(); i++)
+      out[i] = fd[i] == flowdir_nodata ? NA_REAL : acc[i*K + k];
+  }
+  
+  return result;
+}
+
+//' Watersheds from a flow model
+//'
+//' @param model External pointer from d8_model_build
+//' @param target_rc The outlets, as row, column and label
+//' @param nested Label a nested watershed for each outlet, as d8_watershed_nested
+//' @param polygons Return the boundaries of the watersheds as polygon rings instead of a raster
+//' @return a watershed raster, or with polygons = TRUE a list with the vertices of the polygon rings as in d8_watershed_nested
+// [[Rcpp::export]]
+SEXP d8_model_watershed(SEXP model, NumericMatrix target_rc, bool nested, bool polygons = false){
+  const flow_model& m = model_of(model);
+  return d8_watershed_output(m.flowdirs.data(), m.g, target_rc, nested, polygons);
+}
+
+//' Stream network from a flow model
+//'
+//' @param model External pointer from d8_model_build
+//' @param threshold Lowest flow accumulation of stream cells
+//' @param xres Width of cells, used for segment lengths
+//' @param yres Height of cells, used for segment lengths
+//' @return List with a data frame of segments and the cell numbers of the segments, as d8_stream_network
+// [[Rcpp::export]]
+List d8_model_streams(SEXP model, double threshold, double xres = 1, double yres = 1){
+  const flow_model& m = model_of(model);
+  return d8_stream_network_q(m.flowdirs.data(), m.area.data(), m.g, threshold, xres, yres);
+}
+
+//' Cells upstream of outlets from a flow model
+//'
+//' @param model External pointer from d8_model_build
+//' @param cells Outlet cell numbers (row-major, starting at 1 as in terra)
+//' @param count Return the number of cells upstream of each outlet instead of their cell numbers
+//' @return List with the numbers of the cells upstream of each outlet as d8_index_upstream_cells, or their number as d8_index_upstream_count
+// [[Rcpp::export]]
+SEXP d8_model_upstream(SEXP model, IntegerVector cells, bool count = false){
+  const flow_model& m = model_of(model);
+  if(count)
+    return index_upstream_count(m.index, cells);
+  return index_upstream_cells(m.index, cells);
+}
+
+//' Test whether cells are upstream of other cells from a flow model
+//'
+//' @param model External pointer from d8_model_build
+//' @param from Cell numbers (row-major, starting at 1 as in terra)
+//' @param to Cell numbers of the same length as from
+//' @return TRUE where from drains to (or is) to
+// [[Rcpp::export]]
+LogicalVector d8_model_is_upstream(SEXP model, IntegerVector from, IntegerVector to){
+  return index_is_upstream(model_of(model).index, from, to);
+}
+
+// Synthetic DEMs
+
+// Uniform pseudo-random number in [0, 1) from the position of a cell, the layer of noise and the seed (splitmix64 mixing), 
+// so cells can be generated independently and in any order
+static double synthetic_hash(long long x, long long y, int layer, int seed){
+  unsigned long long h = (unsigned long long) x * 0x9E3779B97F4A7C15ULL ^ (unsigned long long) y * 0xC2B2AE3D27D4EB4FULL ^ 
+    (unsigned long long) layer * 0x165667B19E3779F9ULL ^ (unsigned long long) seed * 0xD6E8FEB86659FD93ULL;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  h = h ^ (h >> 31);
+  return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Value noise with the given period in cells, smoothly interpolated between random values on a lattice
+static double synthetic_noise(int r, int c, double period, int layer, int seed){
+  double x = c / period;
+  double y = r / period;
+  long long x0 = (long long) floor(x);
+  long long y0 = (long long) floor(y);
+  double tx = x - x0;
+  double ty = y - y0;
+  tx = tx*tx*(3 - 2*tx);
+  ty = ty*ty*(3 - 2*ty);
+  double top = synthetic_hash(x0, y0, layer, seed)*(1-tx) + synthetic_hash(x0+1, y0, layer, seed)*tx;
+  double bottom = synthetic_hash(x0, y0+1, layer, seed)*(1-tx) + synthetic_hash(x0+1, y0+1, layer, seed)*tx;
+  return top*(1-ty) + bottom*ty;
+}
+
+// Worker generating a range of columns of a synthetic DEM
+struct synthetic_worker : public RcppParallel::Worker {
+  
+  RcppParallel::RMatrix<double> dem;
+  int seed;
+  double pit_density;
+  int octaves;
+  double period;
+  double flat_threshold;
+  
+  synthetic_worker(NumericMatrix dem, int seed, double pit_density, double flat_fraction, int octaves): 
+    dem(dem), seed(seed), pit_density(pit_density), octaves(octaves){
+    
+    period = max(8.0, max(dem.nrow(), dem.ncol()) / 4.0);
+    
+    // The low frequency noise is not uniform, so the threshold for flat terraces is its flat_fraction quantile in a sample of cells
+    vector<double> sample(10000);
+    for(size_t i = 0; i < sample.size(); i++){
+      int r = synthetic_hash(i, 0, -1, seed)*dem.nrow();
+      int c = synthetic_hash(i, 1, -1, seed)*dem.ncol();
+      sample[i] = synthetic_noise(r, c, period / 2, octaves, seed);
+    }
+    sort(sample.begin(), sample.end());
+    flat_threshold = flat_fraction <= 0 ? -1 : sample[min(sample.size()-1, (size_t) (flat_fraction*sample.size()))];
+  }
+  
+  void operator()(size_t begin, size_t end){
+    for(size_t c = begin; c < end; c++){
+      for(size_t r = 0; r < dem.nrow(); r++){
+        
+        // Fractal noise, each octave with half the period and half the amplitude of the previous
+        double z = 0;
+        double amplitude = 1000;
+        double p = period;
+        for(int o = 0; o < octaves; o++){
+          z += amplitude*synthetic_noise(r, c, p, o, seed);
+          amplitude /= 2;
+          p = max(1.0, p / 2);
+        }
+        
+        // Flat terraces where low frequency noise is below the threshold
+        if(synthetic_noise(r, c, period / 2, octaves, seed) < flat_threshold)
+          z = floor(z / 25)*25;
+        
+        // Single cell pits
+        if(synthetic_hash(r, c, octaves+1, seed) < pit_density)
+          z -= 5 + 45*synthetic_hash(r, c, octaves+2, seed);
+        
+        dem(r, c) = z;
+      }
+    }
+  }
+};
+
+//' Deterministic synthetic digital elevation model for testing and benchmarking
+//'
+//' Elevations are fractal value noise between 0 and 2000 m. The same arguments always give the same DEM, regardless of the number of threads.
+//'
+//' @param nrow Number of rows
+//' @param ncol Number of columns
+//' @param seed Seed of the random numbers
+//' @param pit_density Fraction of cells lowered into single cell pits of 5 to 50 m
+//' @param flat_fraction Approximate fraction of the DEM made up of flat terraces
+//' @param octaves Number of layers of noise
+//' @param threads The number of threads
+//' @return The synthetic DEM
+// [[Rcpp::export]]
+NumericMatrix synthetic_dem(int nrow, int ncol, int seed = 1, double pit_density = 0.001, double flat_fraction = 0.1, int octaves = 8, int threads = 1){
+  
+  if(nrow < 1 || ncol < 1)
+    stop("nrow and ncol must be positive");
+  
+  NumericMatrix dem(nrow, ncol);
+  
+  synthetic_worker worker(dem, seed, pit_density, flat_fraction, octaves);
+  RcppParallel::parallelFor(0, ncol, worker, 64, threads);
+  
+  return dem;
 }